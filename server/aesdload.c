@@ -0,0 +1,788 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "hist.h"
+
+// Load generator for aesdsocket. Every connection turns persistent and then
+// sends fixed-size packets, either the next one as soon as the previous one
+// is answered (closed loop) or on a fixed schedule that ignores the answers
+// (open loop). Latency runs from when a packet was due until its reply is
+// complete, so in open-loop mode a server that falls behind cannot hide the
+// queueing it causes. Results go to stdout as one JSON object.
+//
+// With -v every packet carries its connection and sequence number. Once
+// the run is over the store is read back, and every connection's packets
+// must be there intact, in the order it sent them, with none missing.
+#define LOAD_DEFAULT_HOST "127.0.0.1"
+#define LOAD_DEFAULT_PORT "9000"
+#define INFLIGHT_MAX 1024
+#define BURST_PACKETS 64
+#define RECV_BUF_SIZE (64 * 1024)
+#define HEADER_MAX 64
+#define MAX_EVENTS 256
+
+// Verified packets start "<run> <connection> <sequence> ", fixed width
+#define VERIFY_HDR_LEN 29
+#define VERIFY_TIMEOUT_S 30
+
+typedef enum
+{
+    LOAD_REPLY_ACK,  // "AESDPERSIST:ack": one short line per packet
+    LOAD_REPLY_FULL, // "AESDPERSIST": the whole store per packet
+} load_reply_t;
+
+typedef struct
+{
+    const char *host;
+    const char *port;
+    int connections;
+    int threads;
+    size_t packet_size;
+    double duration_s;
+    double rate; // packets per second over all connections; 0 is closed loop
+    load_reply_t reply;
+    int verify;
+} load_config_t;
+
+typedef struct
+{
+    int fd;
+    int dead;
+    uint32_t events;
+    uint64_t next_due; // open loop only
+    uint64_t inflight[INFLIGHT_MAX]; // due times of unanswered packets, oldest first
+    size_t inflight_head;
+    size_t inflight_count;
+    size_t unsent;  // packets due but not fully written
+    size_t out_off; // bytes of the first unsent packet already written
+    char header[HEADER_MAX];
+    size_t header_len;
+    uint64_t body_left;
+    int id;
+    uint64_t next_seq; // -v: sequence number of the first unsent packet
+    char *out;         // -v: the next packets to send, built per flush
+} load_conn_t;
+
+// What reading the store back found
+typedef struct
+{
+    uint64_t records;
+    uint64_t missing;
+    uint64_t reordered;
+    uint64_t malformed;
+    uint64_t foreign; // records of another writer, not checked
+} load_verify_t;
+
+typedef struct
+{
+    pthread_t tid;
+    load_conn_t *conns;
+    int n_conns;
+    int epoll_fd;
+    int timer_fd; // wakes the thread when the next packet is due
+    uint64_t packets;
+    uint64_t bytes_out;
+    uint64_t bytes_in;
+    uint64_t errors;
+    uint64_t overruns;
+    uint64_t lat_sum;
+    uint64_t lat_max;
+    uint64_t hist[HIST_BUCKETS];
+} load_thread_t;
+
+static load_config_t config = {
+    .host = LOAD_DEFAULT_HOST,
+    .port = LOAD_DEFAULT_PORT,
+    .connections = 16,
+    .threads = 1,
+    .packet_size = 64,
+    .duration_s = 10,
+    .reply = LOAD_REPLY_ACK,
+};
+
+// BURST_PACKETS copies of the packet back to back, so one send() can
+// carry several
+static char *burst;
+static uint64_t start_ns;
+static uint64_t deadline_ns;
+static uint64_t interval_ns; // open loop: between packets of one connection
+static unsigned run_id;      // -v: tells this run's packets from older ones
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void load_set_events(load_thread_t *p_thread, load_conn_t *p_conn, uint32_t events)
+{
+    if (p_conn->events == events)
+        return;
+    struct epoll_event ev = {.events = events, .data.ptr = p_conn};
+    epoll_ctl(p_thread->epoll_fd, EPOLL_CTL_MOD, p_conn->fd, &ev);
+    p_conn->events = events;
+}
+
+static void load_fail(load_thread_t *p_thread, load_conn_t *p_conn)
+{
+    epoll_ctl(p_thread->epoll_fd, EPOLL_CTL_DEL, p_conn->fd, NULL);
+    p_conn->dead = 1;
+    p_thread->errors++;
+}
+
+// A packet became due at due_ns
+static void load_due(load_thread_t *p_thread, load_conn_t *p_conn, uint64_t due_ns)
+{
+    if (p_conn->inflight_count == INFLIGHT_MAX)
+    {
+        p_thread->overruns++;
+        return;
+    }
+    p_conn->inflight[(p_conn->inflight_head + p_conn->inflight_count) % INFLIGHT_MAX] = due_ns;
+    p_conn->inflight_count++;
+    p_conn->unsent++;
+}
+
+// Packet seq of connection id for -v: the fixed header, then the filler
+// every packet carries, then the newline
+static void load_fill(char *buf, int id, uint64_t seq)
+{
+    // Room for any id and seq; only the first VERIFY_HDR_LEN bytes go out
+    char header[8 + 1 + 11 + 1 + 20 + 1 + 1];
+
+    snprintf(header, sizeof(header), "%08x %06d %012llu ", run_id, id, (unsigned long long)seq);
+    memcpy(buf, burst, config.packet_size);
+    memcpy(buf, header, VERIFY_HDR_LEN);
+}
+
+static void load_flush(load_thread_t *p_thread, load_conn_t *p_conn)
+{
+    while (p_conn->unsent > 0)
+    {
+        size_t packets = p_conn->unsent < BURST_PACKETS ? p_conn->unsent : BURST_PACKETS;
+        const char *out = burst;
+        if (config.verify)
+        {
+            for (size_t i = 0; i < packets; i++)
+                load_fill(p_conn->out + i * config.packet_size, p_conn->id, p_conn->next_seq + i);
+            out = p_conn->out;
+        }
+        ssize_t n = send(p_conn->fd, out + p_conn->out_off,
+                         packets * config.packet_size - p_conn->out_off, MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                load_set_events(p_thread, p_conn, EPOLLIN | EPOLLOUT);
+            else
+                load_fail(p_thread, p_conn);
+            return;
+        }
+
+        size_t done = p_conn->out_off + n;
+        p_thread->bytes_out += n;
+        p_conn->unsent -= done / config.packet_size;
+        p_conn->next_seq += done / config.packet_size;
+        p_conn->out_off = done % config.packet_size;
+    }
+    load_set_events(p_thread, p_conn, EPOLLIN);
+}
+
+// The reply to the oldest unanswered packet is complete
+static void load_answered(load_thread_t *p_thread, load_conn_t *p_conn, uint64_t now)
+{
+    if (p_conn->inflight_count == 0)
+        return;
+
+    uint64_t due_ns = p_conn->inflight[p_conn->inflight_head];
+    uint64_t latency = now > due_ns ? now - due_ns : 0;
+    p_conn->inflight_head = (p_conn->inflight_head + 1) % INFLIGHT_MAX;
+    p_conn->inflight_count--;
+
+    p_thread->packets++;
+    p_thread->lat_sum += latency;
+    if (latency > p_thread->lat_max)
+        p_thread->lat_max = latency;
+    p_thread->hist[hist_bucket(latency)]++;
+
+    if (config.rate == 0)
+        load_due(p_thread, p_conn, now);
+}
+
+// Full replies are "AESDLEN:<n>\n" and n bytes of store
+static int load_parse_full(load_thread_t *p_thread, load_conn_t *p_conn, const char *buf, size_t len,
+                           uint64_t now)
+{
+    while (len > 0)
+    {
+        if (p_conn->body_left > 0)
+        {
+            size_t skip = len < p_conn->body_left ? len : p_conn->body_left;
+            p_conn->body_left -= skip;
+            buf += skip;
+            len -= skip;
+            if (p_conn->body_left == 0)
+                load_answered(p_thread, p_conn, now);
+            continue;
+        }
+
+        char ch = *buf++;
+        len--;
+        if (p_conn->header_len == HEADER_MAX - 1)
+            return -1;
+        p_conn->header[p_conn->header_len++] = ch;
+        if (ch != '\n')
+            continue;
+
+        unsigned long long body;
+        p_conn->header[p_conn->header_len] = '\0';
+        p_conn->header_len = 0;
+        if (sscanf(p_conn->header, "AESDLEN:%llu", &body) != 1)
+            return -1;
+        p_conn->body_left = body;
+        if (body == 0)
+            load_answered(p_thread, p_conn, now);
+    }
+    return 0;
+}
+
+static void load_read(load_thread_t *p_thread, load_conn_t *p_conn, char *buf)
+{
+    for (;;)
+    {
+        ssize_t n = recv(p_conn->fd, buf, RECV_BUF_SIZE, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+        {
+            load_fail(p_thread, p_conn);
+            return;
+        }
+
+        uint64_t now = now_ns();
+        p_thread->bytes_in += n;
+        if (config.reply == LOAD_REPLY_FULL)
+        {
+            if (load_parse_full(p_thread, p_conn, buf, n, now) != 0)
+            {
+                fprintf(stderr, "Malformed reply\n");
+                load_fail(p_thread, p_conn);
+                return;
+            }
+        }
+        else
+        {
+            for (const char *p = buf; (p = memchr(p, '\n', buf + n - p)) != NULL; p++)
+                load_answered(p_thread, p_conn, now);
+        }
+    }
+
+    if (p_conn->unsent > 0)
+        load_flush(p_thread, p_conn);
+}
+
+static void *load_thread(void *arg)
+{
+    load_thread_t *p_thread = (load_thread_t *)arg;
+    struct epoll_event events[MAX_EVENTS];
+    char *buf = malloc(RECV_BUF_SIZE);
+
+    if (!buf)
+        return NULL;
+
+    for (int i = 0; i < p_thread->n_conns; i++)
+    {
+        load_conn_t *p_conn = &p_thread->conns[i];
+        if (config.rate == 0)
+            load_due(p_thread, p_conn, start_ns);
+        load_flush(p_thread, p_conn);
+    }
+
+    uint64_t now;
+    while ((now = now_ns()) < deadline_ns)
+    {
+        uint64_t wake_ns = deadline_ns;
+
+        if (config.rate > 0)
+        {
+            for (int i = 0; i < p_thread->n_conns; i++)
+            {
+                load_conn_t *p_conn = &p_thread->conns[i];
+                if (p_conn->dead)
+                    continue;
+                int was_idle = p_conn->unsent == 0;
+                for (; p_conn->next_due <= now; p_conn->next_due += interval_ns)
+                    load_due(p_thread, p_conn, p_conn->next_due);
+                if (was_idle && p_conn->unsent > 0)
+                    load_flush(p_thread, p_conn);
+                if (p_conn->next_due < wake_ns)
+                    wake_ns = p_conn->next_due;
+            }
+        }
+
+        // A timerfd keeps schedules to the microsecond, where the epoll
+        // timeout would round them up to whole milliseconds
+        struct itimerspec wake = {.it_value = {.tv_sec = wake_ns / 1000000000, .tv_nsec = wake_ns % 1000000000}};
+        timerfd_settime(p_thread->timer_fd, TFD_TIMER_ABSTIME, &wake, NULL);
+
+        int n = epoll_wait(p_thread->epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno != EINTR)
+        {
+            perror("epoll_wait");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            load_conn_t *p_conn = events[i].data.ptr;
+            if (!p_conn)
+            {
+                uint64_t expirations;
+                read(p_thread->timer_fd, &expirations, sizeof(expirations));
+                continue;
+            }
+            if (!p_conn->dead && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+                load_read(p_thread, p_conn, buf);
+            if (!p_conn->dead && (events[i].events & EPOLLOUT))
+                load_flush(p_thread, p_conn);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// Connected, switched to persistent mode and non-blocking
+static int load_connect(const struct addrinfo *p_res)
+{
+    const char *hello = config.reply == LOAD_REPLY_ACK ? "AESDPERSIST:ack\n" : "AESDPERSIST\n";
+    int one = 1;
+
+    for (const struct addrinfo *p_ai = p_res; p_ai; p_ai = p_ai->ai_next)
+    {
+        int fd = socket(p_ai->ai_family, p_ai->ai_socktype | SOCK_CLOEXEC, p_ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (connect(fd, p_ai->ai_addr, p_ai->ai_addrlen) == 0 &&
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0 &&
+            send(fd, hello, strlen(hello), MSG_NOSIGNAL) == (ssize_t)strlen(hello) &&
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0)
+            return fd;
+        close(fd);
+    }
+    return -1;
+}
+
+static int load_send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Read until the server closes. Returns the bytes in a malloc'd buffer.
+static char *load_recv_all(int fd, size_t *p_len)
+{
+    size_t cap = RECV_BUF_SIZE;
+    size_t len = 0;
+    char *buf = malloc(cap);
+
+    while (buf)
+    {
+        if (len == cap)
+        {
+            char *grown = realloc(buf, cap * 2);
+            if (!grown)
+                break;
+            buf = grown;
+            cap *= 2;
+        }
+        ssize_t n = recv(fd, buf + len, cap - len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            break;
+        if (n == 0)
+        {
+            *p_len = len;
+            return buf;
+        }
+        len += n;
+    }
+    free(buf);
+    return NULL;
+}
+
+// Complete a packet left half written, then close the sending side and let
+// the server answer everything before it closes too
+static void load_finish(load_conn_t *p_conn)
+{
+    struct timeval timeout = {.tv_sec = VERIFY_TIMEOUT_S};
+    size_t len;
+
+    fcntl(p_conn->fd, F_SETFL, fcntl(p_conn->fd, F_GETFL) & ~O_NONBLOCK);
+    setsockopt(p_conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (p_conn->out_off > 0)
+    {
+        load_fill(p_conn->out, p_conn->id, p_conn->next_seq);
+        if (load_send_all(p_conn->fd, p_conn->out + p_conn->out_off, config.packet_size - p_conn->out_off) != 0)
+        {
+            p_conn->dead = 1;
+            return;
+        }
+        p_conn->next_seq++;
+    }
+    shutdown(p_conn->fd, SHUT_WR);
+    free(load_recv_all(p_conn->fd, &len));
+}
+
+// Read the whole store back and check every connection's packets in it
+static int load_verify(const struct addrinfo *p_res, load_conn_t *p_conns, load_verify_t *p_verify)
+{
+    static const char seek[] = "AESDCHAR_IOCSEEKTO:0,0\n";
+    struct timeval timeout = {.tv_sec = VERIFY_TIMEOUT_S};
+    char *expect = malloc(config.packet_size);
+    uint64_t *seen = calloc(config.connections, sizeof(uint64_t));
+    char *store = NULL;
+    size_t len = 0;
+    int fd = -1;
+
+    for (const struct addrinfo *p_ai = p_res; p_ai && fd < 0; p_ai = p_ai->ai_next)
+    {
+        fd = socket(p_ai->ai_family, p_ai->ai_socktype | SOCK_CLOEXEC, p_ai->ai_protocol);
+        if (fd >= 0 && connect(fd, p_ai->ai_addr, p_ai->ai_addrlen) != 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+    {
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (load_send_all(fd, seek, strlen(seek)) == 0 && shutdown(fd, SHUT_WR) == 0)
+            store = load_recv_all(fd, &len);
+        close(fd);
+    }
+    if (!store || !expect || !seen)
+    {
+        fprintf(stderr, "Failed to read the store back\n");
+        free(store);
+        free(expect);
+        free(seen);
+        return -1;
+    }
+
+    char run[9];
+    snprintf(run, sizeof(run), "%08x", run_id);
+    for (size_t off = 0; off < len;)
+    {
+        const char *line = store + off;
+        const char *nl = memchr(line, '\n', len - off);
+        size_t line_len = nl ? (size_t)(nl - line) + 1 : len - off;
+        off += line_len;
+
+        if (line_len < 8 || memcmp(line, run, 8) != 0)
+        {
+            p_verify->foreign++;
+            continue;
+        }
+
+        int id;
+        unsigned long long seq;
+        if (line_len != config.packet_size || sscanf(line + 9, "%6d %12llu", &id, &seq) != 2 ||
+            id < 0 || id >= config.connections)
+        {
+            p_verify->malformed++;
+            continue;
+        }
+        load_fill(expect, id, seq);
+        if (memcmp(line, expect, config.packet_size) != 0)
+        {
+            p_verify->malformed++;
+            continue;
+        }
+
+        // Packets skipped here count as missing; showing up later, or twice,
+        // counts as reordered
+        p_verify->records++;
+        if (seq < seen[id])
+            p_verify->reordered++;
+        else
+        {
+            p_verify->missing += seq - seen[id];
+            seen[id] = seq + 1;
+        }
+    }
+
+    // Packets of a connection that failed may or may not have made it
+    for (int i = 0; i < config.connections; i++)
+    {
+        if (!p_conns[i].dead && seen[i] < p_conns[i].next_seq)
+            p_verify->missing += p_conns[i].next_seq - seen[i];
+    }
+
+    free(store);
+    free(expect);
+    free(seen);
+    return p_verify->missing || p_verify->reordered || p_verify->malformed ? -1 : 0;
+}
+
+static void load_report(const load_thread_t *p_threads, double elapsed_s, const load_verify_t *p_verify)
+{
+    uint64_t hist[HIST_BUCKETS] = {0};
+    uint64_t packets = 0, bytes_out = 0, bytes_in = 0, errors = 0, overruns = 0;
+    uint64_t lat_sum = 0, lat_max = 0;
+
+    for (int t = 0; t < config.threads; t++)
+    {
+        const load_thread_t *p_thread = &p_threads[t];
+        packets += p_thread->packets;
+        bytes_out += p_thread->bytes_out;
+        bytes_in += p_thread->bytes_in;
+        errors += p_thread->errors;
+        overruns += p_thread->overruns;
+        lat_sum += p_thread->lat_sum;
+        if (p_thread->lat_max > lat_max)
+            lat_max = p_thread->lat_max;
+        for (size_t i = 0; i < HIST_BUCKETS; i++)
+            hist[i] += p_thread->hist[i];
+    }
+
+    const unsigned permilles[] = {500, 900, 990, 999};
+    const char *const names[] = {"p50", "p90", "p99", "p999"};
+
+    printf("{\"mode\":\"%s\",\"reply\":\"%s\",\"connections\":%d,\"threads\":%d,"
+           "\"packet_size\":%zu,\"target_rate\":%.0f,\"duration_s\":%.3f,",
+           config.rate > 0 ? "open" : "closed", config.reply == LOAD_REPLY_ACK ? "ack" : "full",
+           config.connections, config.threads, config.packet_size, config.rate, elapsed_s);
+    printf("\"packets\":%llu,\"bytes_out\":%llu,\"bytes_in\":%llu,\"errors\":%llu,\"overruns\":%llu,",
+           (unsigned long long)packets, (unsigned long long)bytes_out, (unsigned long long)bytes_in,
+           (unsigned long long)errors, (unsigned long long)overruns);
+    printf("\"throughput_pps\":%.1f,\"throughput_mbps\":%.3f,\"latency_us\":{",
+           packets / elapsed_s, bytes_out * 8 / elapsed_s / 1e6);
+    for (size_t i = 0; i < sizeof(permilles) / sizeof(permilles[0]); i++)
+    {
+        uint64_t value = hist_percentile(hist, packets, permilles[i]);
+        printf("\"%s\":%.1f,", names[i], (value < lat_max ? value : lat_max) / 1e3);
+    }
+    printf("\"mean\":%.1f,\"max\":%.1f}", packets ? lat_sum / 1e3 / packets : 0.0, lat_max / 1e3);
+    if (p_verify)
+        printf(",\"verify\":{\"records\":%llu,\"missing\":%llu,\"reordered\":%llu,\"malformed\":%llu,"
+               "\"foreign\":%llu}",
+               (unsigned long long)p_verify->records, (unsigned long long)p_verify->missing,
+               (unsigned long long)p_verify->reordered, (unsigned long long)p_verify->malformed,
+               (unsigned long long)p_verify->foreign);
+    printf("}\n");
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-H host] [-p port] [-c connections] [-t threads] [-s packet_size]\n"
+            "          [-d seconds] [-r packets_per_sec] [-m ack|full] [-v]\n"
+            "  -r 0 (default) runs closed loop: each connection sends its next packet\n"
+            "  once the previous one is answered\n"
+            "  -v numbers the packets and afterwards checks the store holds every one,\n"
+            "  in order; fails on any loss. Packets need at least %d bytes.\n",
+            prog, VERIFY_HDR_LEN + 1);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H:p:c:t:s:d:r:m:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 'c':
+            config.connections = atoi(optarg);
+            break;
+        case 't':
+            config.threads = atoi(optarg);
+            break;
+        case 's':
+            config.packet_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            config.duration_s = atof(optarg);
+            break;
+        case 'r':
+            config.rate = atof(optarg);
+            break;
+        case 'm':
+            if (strcmp(optarg, "ack") == 0)
+                config.reply = LOAD_REPLY_ACK;
+            else if (strcmp(optarg, "full") == 0)
+                config.reply = LOAD_REPLY_FULL;
+            else
+                usage(argv[0]);
+            break;
+        case 'v':
+            config.verify = 1;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (config.connections < 1 || config.threads < 1 || config.packet_size < 1 ||
+        config.duration_s <= 0 || config.rate < 0 ||
+        (config.verify && config.packet_size <= VERIFY_HDR_LEN))
+        usage(argv[0]);
+    if (config.threads > config.connections)
+        config.threads = config.connections;
+
+    // Packets are runs of printable bytes ending in the newline that
+    // completes them
+    burst = malloc(config.packet_size * BURST_PACKETS);
+    if (!burst)
+    {
+        perror("malloc");
+        return EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < config.packet_size * BURST_PACKETS; i++)
+        burst[i] = (i + 1) % config.packet_size == 0 ? '\n' : 'a' + i % config.packet_size % 26;
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    struct addrinfo *p_res;
+    int status = getaddrinfo(config.host, config.port, &hints, &p_res);
+    if (status != 0)
+    {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return EXIT_FAILURE;
+    }
+
+    load_thread_t *p_threads = calloc(config.threads, sizeof(load_thread_t));
+    load_conn_t *p_conns = calloc(config.connections, sizeof(load_conn_t));
+    if (!p_threads || !p_conns)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+
+    run_id = (unsigned)getpid() ^ (unsigned)now_ns();
+    for (int i = 0; i < config.connections; i++)
+    {
+        p_conns[i].id = i;
+        p_conns[i].fd = load_connect(p_res);
+        if (p_conns[i].fd < 0)
+        {
+            fprintf(stderr, "Failed to connect to %s:%s\n", config.host, config.port);
+            return EXIT_FAILURE;
+        }
+        if (config.verify && !(p_conns[i].out = malloc(config.packet_size * BURST_PACKETS)))
+        {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+    }
+
+    start_ns = now_ns();
+    deadline_ns = start_ns + (uint64_t)(config.duration_s * 1e9);
+    if (config.rate > 0)
+        interval_ns = (uint64_t)(config.connections * 1e9 / config.rate);
+
+    // Connections are split evenly over the threads; open-loop schedules
+    // are staggered so the packets spread over each interval
+    for (int t = 0, first = 0; t < config.threads; t++)
+    {
+        load_thread_t *p_thread = &p_threads[t];
+        p_thread->conns = p_conns + first;
+        p_thread->n_conns = config.connections / config.threads + (t < config.connections % config.threads);
+        p_thread->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        p_thread->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (p_thread->epoll_fd < 0 || p_thread->timer_fd < 0)
+        {
+            perror("epoll_create1/timerfd_create");
+            return EXIT_FAILURE;
+        }
+
+        // The timer is tagged with a NULL pointer
+        struct epoll_event timer_ev = {.events = EPOLLIN, .data.ptr = NULL};
+        epoll_ctl(p_thread->epoll_fd, EPOLL_CTL_ADD, p_thread->timer_fd, &timer_ev);
+
+        for (int i = 0; i < p_thread->n_conns; i++)
+        {
+            load_conn_t *p_conn = &p_thread->conns[i];
+            struct epoll_event ev = {.events = EPOLLIN, .data.ptr = p_conn};
+            p_conn->events = EPOLLIN;
+            p_conn->next_due = start_ns + (first + i) * interval_ns / config.connections;
+            epoll_ctl(p_thread->epoll_fd, EPOLL_CTL_ADD, p_conn->fd, &ev);
+        }
+        first += p_thread->n_conns;
+    }
+
+    for (int t = 0; t < config.threads; t++)
+    {
+        if (pthread_create(&p_threads[t].tid, NULL, load_thread, &p_threads[t]) != 0)
+        {
+            perror("pthread_create");
+            return EXIT_FAILURE;
+        }
+    }
+    for (int t = 0; t < config.threads; t++)
+        pthread_join(p_threads[t].tid, NULL);
+
+    double elapsed_s = (now_ns() - start_ns) / 1e9;
+
+    load_verify_t verify = {0};
+    int verified = 0;
+    if (config.verify)
+    {
+        for (int i = 0; i < config.connections; i++)
+        {
+            if (!p_conns[i].dead)
+                load_finish(&p_conns[i]);
+        }
+        verified = load_verify(p_res, p_conns, &verify);
+    }
+    freeaddrinfo(p_res);
+    load_report(p_threads, elapsed_s, config.verify ? &verify : NULL);
+
+    for (int t = 0; t < config.threads; t++)
+    {
+        close(p_threads[t].timer_fd);
+        close(p_threads[t].epoll_fd);
+    }
+    for (int i = 0; i < config.connections; i++)
+    {
+        close(p_conns[i].fd);
+        free(p_conns[i].out);
+    }
+    free(p_conns);
+    free(p_threads);
+    free(burst);
+    return verified == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,4 +1,4 @@
-#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -8,59 +8,182 @@
 #include <unistd.h>
 #include <syslog.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <signal.h>
 #include <pthread.h>
 #include <stdatomic.h>
 #include <time.h>
-#include "queue.h"
-
-#define PORT "9000"
-#define BUF_SIZE 1024
-#define DATA_FILE_PATH "/var/tmp/aesdsocketdata"
+#include "aesdsocket.h"
+#include "conn.h"
+#include "event_loop.h"
+#include "worker_pool.h"
+#include "store.h"
+#include "snapshot.h"
+#include "uring.h"
+#include "timer.h"
+#include "shard.h"
+#include "stats.h"
+#include "log_ring.h"
+#include "upgrade.h"
+
+// Period of the timestamp records
+#define TIMESTAMP_INTERVAL_MS 10000
 
 // Global variables
 volatile sig_atomic_t stop_requested = 0;
-pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-// Linked list node structure for threads
-typedef struct thread_slist_s thread_slist_t;
-struct thread_slist_s
-{
-    pthread_t tid;
-    atomic_int thread_done;
-    SLIST_ENTRY(thread_slist_s) entries;
-};
+static volatile sig_atomic_t upgrade_requested = 0;
 
-// Thread argument structure
-typedef struct
+// How accepted clients are served
+typedef enum
 {
-    int client_fd;
-    char ipstr[INET6_ADDRSTRLEN];
-    atomic_int *p_thread_done;
-} thread_args_t;
+    SERVE_POOL,  // blocking sockets on the worker pool
+    SERVE_EPOLL, // one non-blocking epoll loop (default)
+    SERVE_URING, // one io_uring completion loop
+} serve_mode_t;
 
 // Function prototypes
-int get_client_ip(struct sockaddr_storage client_addr, char *ipstr, size_t ipstr_len);
 void handle_signal(int signo);
-void *thread_handle_client(void *arg);
-void *timestamp_thread(void *arg);
+unsigned timestamp_tick(void *arg);
+int open_listener(const struct addrinfo *p_ai, int reuse_port);
+void close_listeners(const int *p_fds, int n);
+int write_pidfile(const char *path);
+int accept_loop(int listen_fd);
 
 int main(int argc, char *argv[])
 {
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
+    if (upgrade_init(argv) != 0)
+        syslog(LOG_WARNING, "Cannot locate own binary, hot upgrade unavailable");
 
     int d_mode = 0;
+    serve_mode_t serve_mode = SERVE_EPOLL;
+    int n_workers = 0;
+    unsigned idle_timeout = 0;
+    int n_shards = 1;
+    int backlog = SOMAXCONN;
+    const char *pidfile = NULL;
+    off_t snap_retain = -1; // snapshot's own default
+    int log_level = LOG_INFO;
+    unsigned log_sample = 1;
+    store_config_t store_config = {.kind = STORE_FILE, .segment_size = STORE_SEGMENT_SIZE_DEFAULT};
     int opt;
 
-    while ((opt = getopt(argc, argv, "d")) != -1)
+    while ((opt = getopt(argc, argv, "deuw:s:WIz:D:S:R:CH:K:t:n:b:L:l:P:M:")) != -1)
     {
         switch (opt)
         {
         case 'd':
             d_mode = 1;
             break;
+        case 'e':
+            serve_mode = SERVE_EPOLL;
+            break;
+        case 'u':
+            serve_mode = SERVE_URING;
+            break;
+        case 'w':
+            // Each worker is held by one client for its whole connection,
+            // so stalled or persistent clients can take them all
+            serve_mode = SERVE_POOL;
+            n_workers = atoi(optarg);
+            break;
+        case 's':
+            if (store_parse_kind(optarg, &store_config.kind) != 0)
+            {
+                printf("Unknown store: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'W':
+            store_config.write_behind = 1;
+            break;
+        case 'I':
+            store_config.persist_index = 1;
+            break;
+        case 'z':
+            if (store_parse_reply_mode(optarg, &store_config.reply_mode) != 0)
+            {
+                printf("Unknown reply mode: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'D':
+            if (store_parse_durability(optarg, &store_config) != 0)
+            {
+                printf("Unknown durability: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'S':
+            if (store_parse_size(optarg, &store_config.segment_size) != 0)
+            {
+                printf("Bad segment size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'R':
+            if (store_parse_retention(optarg, &store_config) != 0)
+            {
+                printf("Bad retention: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'C':
+            store_config.compress = 1;
+            break;
+        case 'H':
+            store_config.ring_depth = atoi(optarg);
+            break;
+        case 'K':
+            store_config.checkpoint_ms = atoi(optarg);
+            if (store_config.checkpoint_ms == 0)
+            {
+                printf("Bad checkpoint interval: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            idle_timeout = atoi(optarg);
+            break;
+        case 'n':
+            n_shards = atoi(optarg);
+            break;
+        case 'b':
+            backlog = atoi(optarg);
+            break;
+        case 'L':
+            if (log_ring_parse_level(optarg, &log_level) != 0)
+            {
+                printf("Unknown log level: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            log_sample = atoi(optarg);
+            break;
+        case 'P':
+            pidfile = optarg;
+            break;
+        case 'M':
+            if (strcmp(optarg, "0") == 0)
+                snap_retain = 0;
+            else if (store_parse_size(optarg, &snap_retain) != 0)
+            {
+                printf("Bad snapshot size: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
-            printf("Usage: %s [-d]\n", argv[0]);
+            printf("Usage: %s [-d] [-e|-u|-w workers] [-s file|mem|mmap|seg|ring] [-W] [-I]\n"
+                   "          [-z copy|sendfile|splice] [-D none|batch|ms] [-S size] [-R size|age]\n"
+                   "          [-C] [-H depth] [-K checkpoint_ms] [-t idle_secs] [-n shards] [-b backlog]\n"
+                   "          [-L err|warning|notice|info|debug] [-l sample] [-P pidfile] [-M size]\n"
+                   "-w serves from a pool of blocking workers, 0 for one per CPU. A worker stays\n"
+                   "with its client until it disconnects, so as many stalled or AESDPERSIST\n"
+                   "clients as workers stop the server; pair it with -t.\n"
+                   "SIGUSR2 hands the listening sockets to a freshly started instance, which\n"
+                   "takes over the pidfile once it serves.\n"
+                   "-M keeps an idle reply snapshot up to size for the next reply (default 1M).\n", argv[0]);
             exit(EXIT_FAILURE);
         }
     }
@@ -78,41 +201,53 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    int sock_fd = socket(p_res->ai_family, p_res->ai_socktype, p_res->ai_protocol);
-    if (sock_fd == -1)
+    if (n_shards < 1)
+        n_shards = 1;
+    if (n_shards > 1 && serve_mode == SERVE_URING)
     {
-        syslog(LOG_ERR, "Failed to create socket");
-        freeaddrinfo(p_res);
-        exit(EXIT_FAILURE);
+        syslog(LOG_WARNING, "io_uring serves a single listener, ignoring shards");
+        n_shards = 1;
     }
 
-    int optval = 1;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+    // Shards each get their own socket on the same port
+    int *sock_fds = malloc(n_shards * sizeof(int));
+    if (!sock_fds)
     {
-        syslog(LOG_ERR, "setsockopt(SO_REUSEADDR) failed");
+        syslog(LOG_ERR, "Memory allocation failed");
         freeaddrinfo(p_res);
-        close(sock_fd);
         exit(EXIT_FAILURE);
     }
-
-    if (bind(sock_fd, p_res->ai_addr, p_res->ai_addrlen) == -1)
+    // An upgrade hands over the sockets clients are already queued on
+    int n_inherited = upgrade_inherit(sock_fds, n_shards);
+    if (n_inherited < 0)
     {
-        syslog(LOG_ERR, "Failed to bind socket");
+        free(sock_fds);
         freeaddrinfo(p_res);
-        close(sock_fd);
         exit(EXIT_FAILURE);
     }
+    for (int i = n_inherited; i < n_shards; i++)
+    {
+        sock_fds[i] = open_listener(p_res, n_shards > 1);
+        if (sock_fds[i] == -1)
+        {
+            close_listeners(sock_fds, i);
+            freeaddrinfo(p_res);
+            exit(EXIT_FAILURE);
+        }
+    }
+    int sock_fd = sock_fds[0];
 
     freeaddrinfo(p_res);
-    syslog(LOG_INFO, "Socket bound to port %s", PORT);
+    syslog(LOG_INFO, "%d socket(s) bound to port %s", n_shards, PORT);
 
-    if (d_mode)
+    // The instance that started an upgrade was already a daemon
+    if (d_mode && n_inherited == 0)
     {
         pid_t pid = fork();
         if (pid < 0)
         {
             syslog(LOG_ERR, "fork() failed");
-            close(sock_fd);
+            close_listeners(sock_fds, n_shards);
             exit(EXIT_FAILURE);
         }
         if (pid > 0)
@@ -121,7 +256,7 @@ int main(int argc, char *argv[])
         if (setsid() < 0)
         {
             syslog(LOG_ERR, "setsid() failed");
-            close(sock_fd);
+            close_listeners(sock_fds, n_shards);
             exit(EXIT_FAILURE);
         }
 
@@ -131,37 +266,221 @@ int main(int argc, char *argv[])
         freopen("/dev/null", "w", stderr);
     }
 
-    if (listen(sock_fd, 5) < 0)
+    for (int i = 0; i < n_shards; i++)
     {
-        syslog(LOG_ERR, "listen() failed");
-        close(sock_fd);
-        exit(EXIT_FAILURE);
+        if (listen(sock_fds[i], backlog) < 0)
+        {
+            syslog(LOG_ERR, "listen() failed");
+            close_listeners(sock_fds, n_shards);
+            exit(EXIT_FAILURE);
+        }
     }
 
     struct sigaction sa = {0};
     sa.sa_handler = handle_signal;
     sigaction(SIGINT, &sa, NULL);
     sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    // Connection messages go through the log ring from here on
+    log_ring_start(log_level, log_sample);
 
-    // Start timestamp thread
-    pthread_t timestamp_tid;
-    if (pthread_create(&timestamp_tid, NULL, timestamp_thread, NULL) != 0)
+    // Threads do not survive the daemon fork, so the store opens afterwards,
+    // and after an upgrade only once the old instance has closed it
+    upgrade_wait();
+    if (store_open(&store_config) != 0)
     {
-        syslog(LOG_ERR, "Failed to create timestamp thread");
-        close(sock_fd);
+        close_listeners(sock_fds, n_shards);
         exit(EXIT_FAILURE);
     }
 
-    // Linked list for threads
-    SLIST_HEAD(thread_slist_head, thread_slist_s) thread_list;
-    SLIST_INIT(&thread_list);
+    // The timer wheel drives the timestamp records and idle timeouts
+    if (timer_start() != 0)
+    {
+        store_close();
+        close_listeners(sock_fds, n_shards);
+        exit(EXIT_FAILURE);
+    }
+    tw_timer_t timestamp_timer;
+    timer_init(&timestamp_timer, timestamp_tick, NULL);
+    timer_arm(&timestamp_timer, TIMESTAMP_INTERVAL_MS);
+    conn_set_idle_timeout(idle_timeout);
+    if (snap_retain >= 0)
+        snapshot_set_retain(snap_retain);
+
+    // Written only now that signals are handled, so whoever signals the pid
+    // in it, after an upgrade too, reaches an instance that is ready
+    if (pidfile && write_pidfile(pidfile) != 0)
+        syslog(LOG_WARNING, "Failed to write pidfile %s", pidfile);
+
+    // Shard threads, and the workers they feed, leave signals to this thread
+    sigset_t signals, orig_signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGUSR2);
+    if (n_shards > 1)
+        pthread_sigmask(SIG_BLOCK, &signals, &orig_signals);
+
+    // Serve until stopped. An upgrade the new instance could not take over
+    // leaves this one serving.
+    int pool_started = 0;
+    int upgrading = 0;
+    for (;;)
+    {
+        // io_uring leaves the listening socket untouched when it is unusable
+        if (serve_mode == SERVE_URING)
+        {
+            int status = uring_run(sock_fd);
+            if (status == URING_UNSUPPORTED)
+            {
+                syslog(LOG_WARNING, "io_uring unavailable, falling back to epoll");
+                serve_mode = SERVE_EPOLL;
+            }
+            else
+            {
+                if (status != 0)
+                    syslog(LOG_ERR, "io_uring loop failed");
+                stop_requested = 1;
+            }
+        }
+
+        if (serve_mode == SERVE_POOL && !stop_requested && !pool_started)
+        {
+            if (worker_pool_start(n_workers) != 0)
+            {
+                syslog(LOG_ERR, "Failed to start worker pool");
+                stop_requested = 1;
+            }
+            pool_started = 1;
+        }
+        // Connections the old instance handed over come first
+        upgrade_adopt(serve_mode == SERVE_POOL && !stop_requested ? worker_pool_submit : NULL);
 
+        if (!stop_requested && n_shards > 1)
+        {
+            if (shard_start(sock_fds, n_shards, serve_mode == SERVE_EPOLL ? event_loop_run : accept_loop) == 0)
+            {
+                while (!stop_requested)
+                    sigsuspend(&orig_signals);
+                shard_stop(upgrade_requested);
+            }
+        }
+        // Event loop mode serves every client from this thread
+        else if (!stop_requested && serve_mode == SERVE_EPOLL)
+        {
+            if (event_loop_run(sock_fd) != 0)
+                syslog(LOG_ERR, "Event loop failed");
+        }
+        else if (!stop_requested)
+            accept_loop(sock_fd);
+        stop_requested = 1;
+
+        if (!upgrade_requested)
+            break;
+        upgrade_requested = 0;
+        upgrading = upgrade_spawn(sock_fds, n_shards) == 0;
+        if (upgrading)
+            break;
+        stop_requested = 0;
+    }
+    syslog(LOG_INFO, upgrading ? "Upgrading, draining clients" : "Caught signal, exiting");
+
+    // Clients still queued are the new instance's to serve
+    if (serve_mode == SERVE_POOL)
+        worker_pool_stop(upgrading ? upgrade_hand_off : NULL);
+
+    timer_stop();
+    close_listeners(sock_fds, n_shards);
+    free(sock_fds);
+    store_close();
+    // The new instance opens the store once it is closed here, and a kept
+    // store is picked up again by the next start
+    if (upgrading)
+        upgrade_release();
+    else
+        store_remove();
+    // After an upgrade the pidfile names the new instance
+    if (pidfile && !upgrading)
+        remove(pidfile);
+    log_ring_stop();
+    closelog();
+
+    return 0;
+}
+
+/* ---------------------------
+   Private function definitions
+   --------------------------- */
+
+// Bound but not yet listening, so the daemon fork can come in between
+int open_listener(const struct addrinfo *p_ai, int reuse_port)
+{
+    int sock_fd = socket(p_ai->ai_family, p_ai->ai_socktype | SOCK_CLOEXEC, p_ai->ai_protocol);
+    if (sock_fd == -1)
+    {
+        syslog(LOG_ERR, "Failed to create socket");
+        return -1;
+    }
+
+    int optval = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0)
+    {
+        syslog(LOG_ERR, "setsockopt(SO_REUSEADDR) failed");
+        close(sock_fd);
+        return -1;
+    }
+
+    // The kernel balances connections over every socket sharing the port
+    if (reuse_port && setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
+    {
+        syslog(LOG_ERR, "setsockopt(SO_REUSEPORT) failed");
+        close(sock_fd);
+        return -1;
+    }
+
+    if (bind(sock_fd, p_ai->ai_addr, p_ai->ai_addrlen) == -1)
+    {
+        syslog(LOG_ERR, "Failed to bind socket");
+        close(sock_fd);
+        return -1;
+    }
+    return sock_fd;
+}
+
+void close_listeners(const int *p_fds, int n)
+{
+    for (int i = 0; i < n; i++)
+        close(p_fds[i]);
+}
+
+// Replaced atomically, so a reader never sees it half written
+int write_pidfile(const char *path)
+{
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *p_file = fopen(tmp_path, "w");
+    if (!p_file)
+        return -1;
+    fprintf(p_file, "%d\n", (int)getpid());
+    if (fclose(p_file) != 0 || rename(tmp_path, path) != 0)
+    {
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+// Hand every accepted client to the worker pool until stop_requested is set
+int accept_loop(int listen_fd)
+{
     while (!stop_requested)
     {
         struct sockaddr_storage client_addr;
         socklen_t client_addr_len = sizeof(client_addr);
 
-        int client_fd = accept(sock_fd, (struct sockaddr *)&client_addr, &client_addr_len);
+        int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_CLOEXEC);
         if (client_fd < 0)
         {
             if (stop_requested)
@@ -170,80 +489,26 @@ int main(int argc, char *argv[])
             continue;
         }
 
-        char ipstr[INET6_ADDRSTRLEN];
-        if (get_client_ip(client_addr, ipstr, INET6_ADDRSTRLEN) != 0)
-        {
-            close(client_fd);
-            continue;
-        }
-
-        syslog(LOG_INFO, "Accepted connection from %s", ipstr);
-
-        thread_args_t *p_thread_args = malloc(sizeof(thread_args_t));
-        thread_slist_t *p_new_node = malloc(sizeof(thread_slist_t));
-
-        if (!p_thread_args || !p_new_node)
+        conn_task_t task;
+        task.accepted_ns = stats_now();
+        if (get_client_ip(client_addr, task.ipstr, INET6_ADDRSTRLEN) != 0)
         {
-            syslog(LOG_ERR, "Memory allocation failed");
             close(client_fd);
-            free(p_thread_args);
-            free(p_new_node);
             continue;
         }
 
-        p_thread_args->client_fd = client_fd;
-        memcpy(p_thread_args->ipstr, ipstr, INET6_ADDRSTRLEN);
-        p_new_node->thread_done = 0;
-        p_thread_args->p_thread_done = &(p_new_node->thread_done);
+        log_conn(LOG_INFO, "Accepted connection from %s", task.ipstr);
 
-        if (pthread_create(&p_new_node->tid, NULL, thread_handle_client, p_thread_args) == 0)
+        task.client_fd = client_fd;
+        if (worker_pool_submit(&task) != 0)
         {
-            SLIST_INSERT_HEAD(&thread_list, p_new_node, entries);
-        }
-        else
-        {
-            syslog(LOG_ERR, "pthread_create() failed for client thread");
+            log_conn(LOG_ERR, "Worker queues full, dropping connection from %s", task.ipstr);
             close(client_fd);
-            free(p_thread_args);
-            free(p_new_node);
         }
-
-        // Clean finished threads
-        thread_slist_t *p_node;
-        thread_slist_t *p_tmp_node;
-        SLIST_FOREACH_SAFE(p_node, &thread_list, entries, p_tmp_node)
-        {
-            if (p_node->thread_done == 1)
-            {
-                pthread_join(p_node->tid, NULL);
-                SLIST_REMOVE(&thread_list, p_node, thread_slist_s, entries);
-                free(p_node);
-            }
-        }
-    }
-
-    // Cleanup: join all threads
-    thread_slist_t *p_node;
-    thread_slist_t *p_tmp_node;
-    SLIST_FOREACH_SAFE(p_node, &thread_list, entries, p_tmp_node)
-    {
-        pthread_join(p_node->tid, NULL);
-        SLIST_REMOVE(&thread_list, p_node, thread_slist_s, entries);
-        free(p_node);
     }
-
-    pthread_join(timestamp_tid, NULL);
-    close(sock_fd);
-    remove(DATA_FILE_PATH);
-    closelog();
-
     return 0;
 }
 
-/* ---------------------------
-   Private function definitions
-   --------------------------- */
-
 int get_client_ip(struct sockaddr_storage client_addr, char *ipstr, size_t ipstr_len)
 {
     void *addr;
@@ -271,76 +536,28 @@ void handle_signal(int signo)
 {
     if (signo == SIGINT || signo == SIGTERM)
     {
-        syslog(LOG_INFO, "Caught signal, exiting");
+        // syslog() is not async-signal-safe; main() logs the exit
         stop_requested = 1;
     }
-}
-
-void *thread_handle_client(void *arg)
-{
-    thread_args_t *p_thread_args = (thread_args_t *)arg;
-    char buffer[BUF_SIZE];
-
-    int data_fd = open(DATA_FILE_PATH, O_CREAT | O_WRONLY | O_APPEND, 0644);
-    if (data_fd == -1)
-    {
-        syslog(LOG_ERR, "Failed to open data file");
-        pthread_exit(NULL);
-    }
-
-    int bytes_read = 0;
-    while ((bytes_read = recv(p_thread_args->client_fd, buffer, BUF_SIZE, 0)) > 0)
+    // Hot upgrade: hand the listening sockets to a new instance and drain
+    else if (signo == SIGUSR2)
     {
-        pthread_mutex_lock(&file_mutex);
-        write(data_fd, buffer, bytes_read);
-        pthread_mutex_unlock(&file_mutex);
-
-        if (memchr(buffer, '\n', bytes_read))
-            break;
-    }
-
-    close(data_fd);
-
-    data_fd = open(DATA_FILE_PATH, O_RDONLY);
-    while ((bytes_read = read(data_fd, buffer, BUF_SIZE)) > 0)
-    {
-        send(p_thread_args->client_fd, buffer, bytes_read, 0);
+        upgrade_requested = 1;
+        stop_requested = 1;
     }
-    close(data_fd);
-
-    close(p_thread_args->client_fd);
-    syslog(LOG_INFO, "Closed connection from %s", p_thread_args->ipstr);
-
-    *(p_thread_args->p_thread_done) = 1;
-    free(p_thread_args);
-    return NULL;
 }
 
-void *timestamp_thread(void *arg)
+unsigned timestamp_tick(void *arg)
 {
     (void)arg;
-    while (!stop_requested)
-    {
-        sleep(10);
-        if (stop_requested)
-            break;
-
-        time_t now = time(NULL);
-        struct tm *tm_info = localtime(&now);
-        char time_str[128];
-        strftime(time_str, sizeof(time_str), "%a, %d %b %Y %T %z", tm_info);
+    time_t now = time(NULL);
+    struct tm *tm_info = localtime(&now);
+    char time_str[128];
+    strftime(time_str, sizeof(time_str), "%a, %d %b %Y %T %z", tm_info);
 
-        char line[160];
-        snprintf(line, sizeof(line), "timestamp:%s\n", time_str);
+    char line[160];
+    snprintf(line, sizeof(line), "timestamp:%s\n", time_str);
 
-        pthread_mutex_lock(&file_mutex);
-        int fd = open(DATA_FILE_PATH, O_CREAT | O_WRONLY | O_APPEND, 0644);
-        if (fd >= 0)
-        {
-            write(fd, line, strlen(line));
-            close(fd);
-        }
-        pthread_mutex_unlock(&file_mutex);
-    }
-    return NULL;
+    store_append(line, strlen(line));
+    return TIMESTAMP_INTERVAL_MS;
 }
@@ -0,0 +1,22 @@
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <signal.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define PORT "9000"
+#define BUF_SIZE 1024
+#define DATA_FILE_PATH "/var/tmp/aesdsocketdata"
+#define INDEX_FILE_PATH DATA_FILE_PATH ".idx"
+#define MANIFEST_FILE_PATH DATA_FILE_PATH ".manifest"
+#define CHECKPOINT_FILE_PATH DATA_FILE_PATH ".ckpt"
+
+// Shared state owned by aesdsocket.c
+extern volatile sig_atomic_t stop_requested;
+
+int get_client_ip(struct sockaddr_storage client_addr, char *ipstr, size_t ipstr_len);
+
+#endif /* AESDSOCKET_H */
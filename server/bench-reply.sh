@@ -0,0 +1,52 @@
+#!/bin/sh
+# Compare the reply paths: replay a pre-filled file store with aesdload -m
+# full under -z copy, sendfile and splice, and report the server CPU time
+# spent per MB replayed.
+#
+# Usage: bench-reply.sh [fill_seconds] [bench_seconds]   (run from server/ after make)
+# The store grows by 8 MB per fill second.
+
+AESDSOCKET=${AESDSOCKET:-./aesdsocket}
+AESDLOAD=${AESDLOAD:-./aesdload}
+FILL=${1:-2}
+DURATION=${2:-5}
+DATA=/var/tmp/aesdsocketdata
+TICK=$(getconf CLK_TCK)
+
+# utime + stime of a process, in clock ticks
+cpu_ticks() {
+    awk '{ print $14 + $15 }' "/proc/$1/stat"
+}
+
+json_field() {
+    sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p"
+}
+
+# -K keeps the store between the runs, so every mode replays the same data
+rm -f "$DATA" "$DATA".*
+$AESDSOCKET -K 1000 &
+pid=$!
+sleep 0.5
+$AESDLOAD -m ack -c 8 -s 4096 -r 2048 -d "$FILL" > /dev/null
+kill "$pid"
+wait "$pid"
+echo "store: $(stat -c %s "$DATA") bytes"
+
+printf "%-10s %12s %12s %12s\n" mode replayed_mb cpu_s cpu_ms_per_mb
+for mode in copy sendfile splice; do
+    $AESDSOCKET -K 1000 -z "$mode" &
+    pid=$!
+    sleep 0.5
+
+    before=$(cpu_ticks "$pid")
+    bytes=$($AESDLOAD -m full -c 4 -s 16 -d "$DURATION" | json_field bytes_in)
+    after=$(cpu_ticks "$pid")
+
+    kill "$pid"
+    wait "$pid"
+    echo "$mode $bytes $before $after" | awk -v tick="$TICK" '{
+        mb = $2 / 1048576; cpu = ($4 - $3) / tick;
+        printf "%-10s %12.1f %12.2f %12.3f\n", $1, mb, cpu, (mb > 0 ? cpu * 1000 / mb : 0) }'
+done
+
+rm -f "$DATA" "$DATA".*
@@ -0,0 +1,158 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "buf_pool.h"
+#include "stats.h"
+
+// Free buffers are chained through their first bytes, one list per class.
+// Each list keeps at most POOL_CLASS_KEEP buffers; the rest go back to malloc.
+// In front of the shared lists every thread caches up to POOL_THREAD_KEEP
+// buffers per class, so a connection that stages and frees on one thread
+// never takes the pool mutex.
+#define POOL_CLASS_COUNT 11 // BUF_SIZE << 0 .. BUF_SIZE << 10
+#define POOL_CLASS_KEEP 64
+#define POOL_THREAD_KEEP 4
+
+typedef struct free_buf
+{
+    struct free_buf *p_next;
+} free_buf_t;
+
+typedef struct
+{
+    free_buf_t *lists[POOL_CLASS_COUNT];
+    size_t counts[POOL_CLASS_COUNT];
+} thread_cache_t;
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static free_buf_t *free_lists[POOL_CLASS_COUNT];
+static size_t free_counts[POOL_CLASS_COUNT];
+
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static int cache_key_ok;
+
+static int pool_class(size_t len)
+{
+    int cls = 0;
+    while (cls < POOL_CLASS_COUNT && ((size_t)BUF_SIZE << cls) < len)
+        cls++;
+    return cls;
+}
+
+// Hand a buffer to the shared list of its class, or free it when full
+static void pool_shared_put(int cls, free_buf_t *p_buf)
+{
+    pthread_mutex_lock(&pool_mutex);
+    if (free_counts[cls] < POOL_CLASS_KEEP)
+    {
+        p_buf->p_next = free_lists[cls];
+        free_lists[cls] = p_buf;
+        free_counts[cls]++;
+        p_buf = NULL;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    free(p_buf);
+}
+
+// The thread is exiting: its cached buffers go back to the shared lists
+static void thread_cache_release(void *arg)
+{
+    thread_cache_t *p_tc = arg;
+
+    for (int cls = 0; cls < POOL_CLASS_COUNT; cls++)
+    {
+        while (p_tc->lists[cls])
+        {
+            free_buf_t *p_buf = p_tc->lists[cls];
+            p_tc->lists[cls] = p_buf->p_next;
+            pool_shared_put(cls, p_buf);
+        }
+    }
+    free(p_tc);
+}
+
+static void thread_cache_key_init(void)
+{
+    cache_key_ok = pthread_key_create(&cache_key, thread_cache_release) == 0;
+}
+
+// This thread's cache, created on first use; NULL if that fails
+static thread_cache_t *thread_cache(void)
+{
+    pthread_once(&cache_once, thread_cache_key_init);
+    if (!cache_key_ok)
+        return NULL;
+
+    thread_cache_t *p_tc = pthread_getspecific(cache_key);
+    if (!p_tc)
+    {
+        p_tc = calloc(1, sizeof(thread_cache_t));
+        if (p_tc && pthread_setspecific(cache_key, p_tc) != 0)
+        {
+            free(p_tc);
+            p_tc = NULL;
+        }
+    }
+    return p_tc;
+}
+
+char *buf_pool_get(size_t min_len, size_t *p_cap)
+{
+    int cls = pool_class(min_len);
+
+    if (cls == POOL_CLASS_COUNT)
+    {
+        stats_add(STAT_BUF_MISSES, 1);
+        *p_cap = min_len;
+        return malloc(min_len);
+    }
+
+    *p_cap = (size_t)BUF_SIZE << cls;
+    thread_cache_t *p_tc = thread_cache();
+    if (p_tc && p_tc->lists[cls])
+    {
+        free_buf_t *p_buf = p_tc->lists[cls];
+        p_tc->lists[cls] = p_buf->p_next;
+        p_tc->counts[cls]--;
+        stats_add(STAT_BUF_HITS, 1);
+        return (char *)p_buf;
+    }
+
+    pthread_mutex_lock(&pool_mutex);
+    free_buf_t *p_buf = free_lists[cls];
+    if (p_buf)
+    {
+        free_lists[cls] = p_buf->p_next;
+        free_counts[cls]--;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    stats_add(p_buf ? STAT_BUF_HITS : STAT_BUF_MISSES, 1);
+    return p_buf ? (char *)p_buf : malloc(*p_cap);
+}
+
+void buf_pool_put(char *buf, size_t cap)
+{
+    int cls = pool_class(cap);
+
+    if (!buf)
+        return;
+    if (cls < POOL_CLASS_COUNT && ((size_t)BUF_SIZE << cls) == cap)
+    {
+        thread_cache_t *p_tc = thread_cache();
+        if (p_tc && p_tc->counts[cls] < POOL_THREAD_KEEP)
+        {
+            free_buf_t *p_buf = (free_buf_t *)buf;
+            p_buf->p_next = p_tc->lists[cls];
+            p_tc->lists[cls] = p_buf;
+            p_tc->counts[cls]++;
+            return;
+        }
+        pool_shared_put(cls, (free_buf_t *)buf);
+        return;
+    }
+    free(buf);
+}
@@ -0,0 +1,16 @@
+#ifndef BUF_POOL_H
+#define BUF_POOL_H
+
+#include <stddef.h>
+
+// Recycles variable-size byte buffers in power-of-two size classes from
+// BUF_SIZE up to 1 MiB, with a small per-thread cache in front of the shared
+// lists. Larger buffers bypass the pool.
+
+// A buffer of at least min_len bytes; its real capacity goes to *p_cap
+char *buf_pool_get(size_t min_len, size_t *p_cap);
+
+// Give back a buffer obtained from buf_pool_get() with its capacity
+void buf_pool_put(char *buf, size_t cap);
+
+#endif /* BUF_POOL_H */
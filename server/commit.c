@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <sched.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "commit.h"
+
+// Bounded multi-producer/single-consumer ring of append requests. A producer
+// claims a position with one fetch-add, fills the slot and publishes it by
+// bumping the slot's sequence number; the flusher thread drains published
+// slots in position order. A slot at position pos is free for that lap when
+// its sequence is pos and published when it is pos + 1.
+#define RING_SLOTS 4096
+#define RING_MASK (RING_SLOTS - 1)
+
+// Upper bound on the chunks the flusher writes with one vectored append
+#define COMMIT_BATCH_MAX 256
+
+typedef struct
+{
+    _Atomic uint64_t seq;
+    const void *buf;
+    size_t len;
+    int result;
+} ring_slot_t;
+
+static ring_slot_t ring[RING_SLOTS];
+static _Atomic uint64_t reserve_pos;
+static _Atomic uint64_t done_pos; // every position below has been written
+
+// Futex words: producers bump submit_word after publishing, the flusher
+// bumps done_word after advancing done_pos. Wakes are only issued when
+// somebody announced that it sleeps.
+static _Atomic uint32_t submit_word;
+static _Atomic uint32_t done_word;
+static _Atomic int flusher_waiting;
+static _Atomic int producers_waiting;
+static _Atomic int closing;
+
+static pthread_t flusher_tid;
+static durability_t durability;
+
+// Warm restart: the flusher checkpoints the store between batches, when
+// nothing else writes it or the record index
+static unsigned checkpoint_ms;
+static uint64_t next_checkpoint_ms;
+
+// Interval durability: a syncer thread flushes whatever was written since
+// its last pass
+static pthread_t syncer_tid;
+static pthread_mutex_t syncer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t syncer_cond;
+static unsigned sync_interval_ms;
+static _Atomic int dirty;
+static int syncer_closing;
+
+static const char *const durability_names[] = {
+    [DURABLE_NONE] = "none",
+    [DURABLE_INTERVAL] = "interval",
+    [DURABLE_BATCH] = "batch",
+};
+
+static void futex_wait(_Atomic uint32_t *p_word, uint32_t val)
+{
+    syscall(SYS_futex, (uint32_t *)p_word, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake_all(_Atomic uint32_t *p_word)
+{
+    syscall(SYS_futex, (uint32_t *)p_word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+static uint64_t commit_now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int ring_published(uint64_t pos)
+{
+    return atomic_load_explicit(&ring[pos & RING_MASK].seq, memory_order_acquire) == pos + 1;
+}
+
+static void *commit_flusher_thread(void *arg)
+{
+    (void)arg;
+    struct iovec iov[COMMIT_BATCH_MAX];
+    uint64_t pos = 0;
+
+    for (;;)
+    {
+        if (!ring_published(pos))
+        {
+            if (atomic_load(&closing))
+                break;
+
+            // Announce the sleep before the last look, so a producer that
+            // publishes meanwhile either is seen here or sees us waiting
+            uint32_t word = atomic_load(&submit_word);
+            atomic_store(&flusher_waiting, 1);
+            if (!ring_published(pos) && !atomic_load(&closing))
+                futex_wait(&submit_word, word);
+            atomic_store(&flusher_waiting, 0);
+            continue;
+        }
+
+        int n = 0;
+        while (n < COMMIT_BATCH_MAX && ring_published(pos + n))
+        {
+            ring_slot_t *p_slot = &ring[(pos + n) & RING_MASK];
+            iov[n].iov_base = (void *)p_slot->buf;
+            iov[n].iov_len = p_slot->len;
+            n++;
+        }
+
+        int result = store_write_batch(iov, n);
+        if (result == 0 && durability == DURABLE_BATCH)
+            result = store_sync();
+        if (result == 0 && durability == DURABLE_INTERVAL)
+            atomic_store(&dirty, 1);
+
+        for (int i = 0; i < n; i++)
+            ring[(pos + i) & RING_MASK].result = result;
+        pos += n;
+        atomic_store_explicit(&done_pos, pos, memory_order_release);
+        atomic_fetch_add(&done_word, 1);
+        if (atomic_load(&producers_waiting) > 0)
+            futex_wake_all(&done_word);
+
+        // Only after the batch is acknowledged, so its appenders do not wait
+        if (result == 0 && checkpoint_ms && commit_now_ms() >= next_checkpoint_ms)
+        {
+            store_checkpoint();
+            next_checkpoint_ms = commit_now_ms() + checkpoint_ms;
+        }
+    }
+    return NULL;
+}
+
+static void *commit_syncer_thread(void *arg)
+{
+    (void)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&syncer_mutex);
+    while (!syncer_closing)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += sync_interval_ms / 1000;
+        deadline.tv_nsec += (long)(sync_interval_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (!syncer_closing && pthread_cond_timedwait(&syncer_cond, &syncer_mutex, &deadline) != ETIMEDOUT)
+            ;
+
+        if (atomic_exchange(&dirty, 0))
+        {
+            pthread_mutex_unlock(&syncer_mutex);
+            store_sync();
+            pthread_mutex_lock(&syncer_mutex);
+        }
+    }
+    pthread_mutex_unlock(&syncer_mutex);
+    return NULL;
+}
+
+int commit_open(const store_config_t *p_config)
+{
+    durability = p_config->durability;
+    sync_interval_ms = p_config->sync_interval_ms;
+    checkpoint_ms = p_config->checkpoint_ms;
+    next_checkpoint_ms = commit_now_ms() + checkpoint_ms;
+    atomic_store(&dirty, 0);
+    atomic_store(&closing, 0);
+    syncer_closing = 0;
+
+    for (uint64_t i = 0; i < RING_SLOTS; i++)
+        atomic_store(&ring[i].seq, i);
+    atomic_store(&reserve_pos, 0);
+    atomic_store(&done_pos, 0);
+
+    if (pthread_create(&flusher_tid, NULL, commit_flusher_thread, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to create commit flusher thread");
+        return -1;
+    }
+
+    if (durability == DURABLE_INTERVAL)
+    {
+        pthread_condattr_t attr;
+        pthread_condattr_init(&attr);
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+        pthread_cond_init(&syncer_cond, &attr);
+        pthread_condattr_destroy(&attr);
+
+        if (pthread_create(&syncer_tid, NULL, commit_syncer_thread, NULL) != 0)
+        {
+            syslog(LOG_ERR, "Failed to create sync thread");
+            pthread_cond_destroy(&syncer_cond);
+            durability = DURABLE_NONE;
+            checkpoint_ms = 0;
+            commit_close();
+            return -1;
+        }
+    }
+
+    syslog(LOG_INFO, "Commit ring with %s durability", durability_names[durability]);
+    return 0;
+}
+
+void commit_close(void)
+{
+    // Producers are gone by now; the flusher drains what is left and exits
+    atomic_store(&closing, 1);
+    atomic_fetch_add(&submit_word, 1);
+    futex_wake_all(&submit_word);
+    pthread_join(flusher_tid, NULL);
+
+    if (durability == DURABLE_INTERVAL)
+    {
+        pthread_mutex_lock(&syncer_mutex);
+        syncer_closing = 1;
+        pthread_cond_signal(&syncer_cond);
+        pthread_mutex_unlock(&syncer_mutex);
+
+        pthread_join(syncer_tid, NULL);
+        pthread_cond_destroy(&syncer_cond);
+    }
+    if (durability != DURABLE_NONE)
+        store_sync();
+    // The last checkpoint covers everything, so the next start scans nothing
+    if (checkpoint_ms)
+        store_checkpoint();
+}
+
+int commit_append(const void *buf, size_t len)
+{
+    uint64_t pos = atomic_fetch_add(&reserve_pos, 1);
+    ring_slot_t *p_slot = &ring[pos & RING_MASK];
+
+    // Only a full lap of producers still holding their slots makes us wait
+    while (atomic_load_explicit(&p_slot->seq, memory_order_acquire) != pos)
+        sched_yield();
+
+    p_slot->buf = buf;
+    p_slot->len = len;
+    atomic_store_explicit(&p_slot->seq, pos + 1, memory_order_release);
+    atomic_fetch_add(&submit_word, 1);
+    if (atomic_load(&flusher_waiting))
+        futex_wake_all(&submit_word);
+
+    // The reply that follows must see this chunk, so wait for the flusher
+    while (atomic_load_explicit(&done_pos, memory_order_acquire) <= pos)
+    {
+        uint32_t word = atomic_load(&done_word);
+        atomic_fetch_add(&producers_waiting, 1);
+        if (atomic_load_explicit(&done_pos, memory_order_acquire) <= pos)
+            futex_wait(&done_word, word);
+        atomic_fetch_sub(&producers_waiting, 1);
+    }
+
+    // The slot stays ours until its result is read, then serves the next lap
+    int result = p_slot->result;
+    atomic_store_explicit(&p_slot->seq, pos + RING_SLOTS, memory_order_release);
+    return result;
+}
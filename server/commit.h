@@ -0,0 +1,16 @@
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stddef.h>
+#include "store.h"
+
+// Commit stage in front of the store backend. Appenders claim a slot in a
+// lock-free ring and wait for a single flusher thread, which writes every
+// chunk queued so far with one vectored append, in the order the slots
+// were claimed.
+int commit_open(const store_config_t *p_config);
+void commit_close(void);
+
+int commit_append(const void *buf, size_t len);
+
+#endif /* COMMIT_H */
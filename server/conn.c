@@ -0,0 +1,913 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "conn.h"
+#include "store.h"
+#include "buf_pool.h"
+#include "stats.h"
+#include "log_ring.h"
+
+// Upper bound for one zero-copy send, so an event loop stays fair
+#define REPLY_CHUNK (256 * 1024)
+
+// A packet still without its newline at this size is committed in pieces
+#define STAGE_MAX (16 * 1024 * 1024)
+
+static unsigned idle_timeout_ms;
+
+void conn_set_idle_timeout(unsigned secs)
+{
+    idle_timeout_ms = secs * 1000;
+}
+
+// Only a connection idle for the whole timeout is shut down; any progress
+// since the timer was armed just pushes the deadline out
+static unsigned conn_idle_check(void *p_arg)
+{
+    conn_t *p_conn = p_arg;
+    uint64_t idle_ticks = timer_now() - atomic_load_explicit(&p_conn->last_active, memory_order_relaxed);
+    uint64_t timeout_ticks = idle_timeout_ms / TIMER_TICK_MS;
+
+    if (idle_ticks < timeout_ticks)
+        return (timeout_ticks - idle_ticks) * TIMER_TICK_MS;
+
+    // The driver sees end of file or an error next and finishes the connection
+    atomic_store(&p_conn->timed_out, 1);
+    stats_add(STAT_EVICTIONS, 1);
+    log_conn(LOG_INFO, "Evicting idle connection from %s", p_conn->ipstr);
+    shutdown(p_conn->client_fd, SHUT_RDWR);
+    return 0;
+}
+
+void conn_touch(conn_t *p_conn)
+{
+    atomic_store_explicit(&p_conn->last_active, timer_now(), memory_order_relaxed);
+}
+
+void conn_sent(conn_t *p_conn, size_t n)
+{
+    stats_add(STAT_BYTES_OUT, n);
+    conn_touch(p_conn);
+}
+
+void conn_init(conn_t *p_conn, int client_fd, const char *ipstr)
+{
+    stats_add(STAT_CONNECTIONS, 1);
+    p_conn->client_fd = client_fd;
+    memcpy(p_conn->ipstr, ipstr, INET6_ADDRSTRLEN);
+    p_conn->state = CONN_RECV;
+    p_conn->copy_reply = !store_zero_copy();
+    p_conn->sniffing = 1;
+    p_conn->resume = 0;
+    p_conn->persist = PERSIST_OFF;
+    p_conn->packets = 0;
+    p_conn->eof = 0;
+    p_conn->stats = 0;
+    p_conn->compress = 0;
+    p_conn->framed = 0;
+    p_conn->frame_hdr_len = 0;
+    p_conn->frame_len = 0;
+    p_conn->frame_backlog = 0;
+    p_conn->frame_error = NULL;
+    p_conn->p_zblock = NULL;
+    p_conn->zblock_sent = 0;
+    p_conn->raw_left = 0;
+    p_conn->seek = 0;
+    p_conn->reply_off = 0;
+    p_conn->reply_end = -1;
+    p_conn->p_snap = NULL;
+    p_conn->line_len = 0;
+    p_conn->stage = NULL;
+    p_conn->stage_len = 0;
+    p_conn->stage_cap = 0;
+    p_conn->buf_len = 0;
+    p_conn->buf_sent = 0;
+    atomic_store(&p_conn->timed_out, 0);
+    conn_touch(p_conn);
+    timer_init(&p_conn->idle_timer, conn_idle_check, p_conn);
+    if (idle_timeout_ms > 0)
+        timer_arm(&p_conn->idle_timer, idle_timeout_ms);
+}
+
+static int conn_stage_reserve(conn_t *p_conn, size_t len)
+{
+    size_t need = p_conn->stage_len + len;
+    size_t want = p_conn->stage_cap ? p_conn->stage_cap : BUF_SIZE;
+    size_t cap;
+
+    if (need <= p_conn->stage_cap)
+        return 0;
+    while (want < need)
+        want *= 2;
+
+    char *stage = buf_pool_get(want, &cap);
+    if (!stage)
+    {
+        log_conn(LOG_ERR, "Out of memory staging a packet from %s", p_conn->ipstr);
+        return -1;
+    }
+    if (p_conn->stage_len > 0)
+        memcpy(stage, p_conn->stage, p_conn->stage_len);
+    buf_pool_put(p_conn->stage, p_conn->stage_cap);
+    p_conn->stage = stage;
+    p_conn->stage_cap = cap;
+    return 0;
+}
+
+// Append one packet, or a piece of one, that began arriving at since_ns
+static int conn_commit(const char *buf, size_t len, uint64_t since_ns)
+{
+    if (store_append(buf, len) != 0)
+    {
+        stats_add(STAT_ERRORS, 1);
+        return -1;
+    }
+    stats_add(STAT_PACKETS, 1);
+    stats_record(STAT_PHASE_RECV_COMMIT, stats_now() - since_ns);
+    return 0;
+}
+
+static int conn_stage_commit(conn_t *p_conn)
+{
+    int ret = conn_commit(p_conn->stage, p_conn->stage_len, p_conn->stage_ns);
+    p_conn->stage_len = 0;
+    return ret;
+}
+
+// Commit every complete packet in buf with one append each and keep what
+// follows the last newline staged for the next one. A persistent connection
+// commits only its first packet here; the rest waits for its own reply,
+// up to STAGE_MAX held at once. Returns 1 if a packet was committed, 0 if not and -1 when the store
+// rejected one.
+static int conn_stage(conn_t *p_conn, const char *buf, size_t len)
+{
+    int committed = 0;
+
+    while (len > 0)
+    {
+        if (committed && p_conn->persist)
+        {
+            if (p_conn->stage_len + len > STAGE_MAX)
+            {
+                log_conn(LOG_ERR, "Too much pipelined data held for %s", p_conn->ipstr);
+                stats_add(STAT_ERRORS, 1);
+                return -1;
+            }
+            if (conn_stage_reserve(p_conn, len) != 0)
+                return -1;
+            if (p_conn->stage_len == 0)
+                p_conn->stage_ns = p_conn->recv_ns;
+            memcpy(p_conn->stage + p_conn->stage_len, buf, len);
+            p_conn->stage_len += len;
+            break;
+        }
+
+        const char *nl = memchr(buf, '\n', len);
+        size_t take = nl ? (size_t)(nl - buf) + 1 : len;
+
+        if (nl && p_conn->stage_len == 0)
+        {
+            // A packet that arrived in one piece needs no staging
+            if (conn_commit(buf, take, p_conn->recv_ns) != 0)
+                return -1;
+        }
+        else
+        {
+            if (conn_stage_reserve(p_conn, take) != 0)
+                return -1;
+            if (p_conn->stage_len == 0)
+                p_conn->stage_ns = p_conn->recv_ns;
+            memcpy(p_conn->stage + p_conn->stage_len, buf, take);
+            p_conn->stage_len += take;
+            if ((nl || p_conn->stage_len >= STAGE_MAX) && conn_stage_commit(p_conn) != 0)
+                return -1;
+        }
+        committed |= nl != NULL;
+        buf += take;
+        len -= take;
+    }
+    return committed;
+}
+
+// Whether the bytes held so far still match the control line prefix
+static int conn_line_may_be_command(const conn_t *p_conn)
+{
+    size_t n = p_conn->line_len < strlen(CMD_PREFIX) ? p_conn->line_len : strlen(CMD_PREFIX);
+    return memcmp(p_conn->line, CMD_PREFIX, n) == 0;
+}
+
+static int conn_parse_resume(conn_t *p_conn, const char *args)
+{
+    char *end;
+
+    p_conn->resume = 1;
+    p_conn->resume_gen = 0;
+    p_conn->resume_off = 0;
+    if (*args == '\n')
+        return 1;
+    if (*args++ != ':')
+        return 0;
+
+    p_conn->resume_gen = strtoull(args, &end, 10);
+    if (end == args || *end != ':')
+        return 0;
+    args = end + 1;
+    p_conn->resume_off = strtoll(args, &end, 10);
+    return end != args && *end == '\n' && p_conn->resume_off >= 0;
+}
+
+static int conn_parse_seek(conn_t *p_conn, const char *args)
+{
+    char *end;
+
+    if (*args++ != ':' || *args < '0' || *args > '9')
+        return 0;
+    uint64_t record = strtoull(args, &end, 10);
+    if (*end != ',')
+        return 0;
+    args = end + 1;
+    if (*args < '0' || *args > '9')
+        return 0;
+    uint64_t byte = strtoull(args, &end, 10);
+    if (*end != '\n')
+        return 0;
+
+    p_conn->seek = 1;
+    if (store_seek(record, byte, &p_conn->seek_off) != 0)
+        p_conn->seek_off = -1;
+    return 1;
+}
+
+static int conn_parse_persist(conn_t *p_conn, const char *args, size_t len)
+{
+    if (len == strlen("\n") && memcmp(args, "\n", len) == 0)
+        p_conn->persist = PERSIST_FULL;
+    else if (len == strlen(":ack\n") && memcmp(args, ":ack\n", len) == 0)
+        p_conn->persist = PERSIST_ACK;
+    return p_conn->persist != PERSIST_OFF;
+}
+
+// Act on a complete control line. Returns 0 if it was not a known command,
+// 1 if it was and 2 if it wants its reply right away.
+static int conn_command(conn_t *p_conn)
+{
+    if (strncmp(p_conn->line, CMD_RESUME, strlen(CMD_RESUME)) == 0)
+    {
+        if (conn_parse_resume(p_conn, p_conn->line + strlen(CMD_RESUME)))
+            return 1;
+        p_conn->resume = 0;
+    }
+    if (strncmp(p_conn->line, CMD_PERSIST, strlen(CMD_PERSIST)) == 0)
+    {
+        if (conn_parse_persist(p_conn, p_conn->line + strlen(CMD_PERSIST),
+                               p_conn->line_len - strlen(CMD_PERSIST)))
+            return 1;
+    }
+    if (p_conn->line_len == strlen(CMD_COMPRESS "\n") &&
+        memcmp(p_conn->line, CMD_COMPRESS "\n", p_conn->line_len) == 0)
+    {
+        p_conn->compress = 1;
+        return 1;
+    }
+    if (p_conn->line_len == strlen(CMD_STATS "\n") &&
+        memcmp(p_conn->line, CMD_STATS "\n", p_conn->line_len) == 0)
+    {
+        p_conn->stats = 1;
+        return 2;
+    }
+    if (strncmp(p_conn->line, CMD_SEEKTO, strlen(CMD_SEEKTO)) == 0)
+    {
+        if (conn_parse_seek(p_conn, p_conn->line + strlen(CMD_SEEKTO)))
+            return 2;
+    }
+    return 0;
+}
+
+// Hold back the first bytes of a connection while they could still be a
+// control line. Anything that turns out not to be one is stored unchanged.
+// Returns like conn_ingest() and reports in *p_used how much of buf it took.
+static int conn_sniff(conn_t *p_conn, const char *buf, size_t len, size_t *p_used)
+{
+    size_t n = 0;
+    int complete = 0;
+
+    while (n < len && p_conn->line_len < CMD_LINE_MAX)
+    {
+        char ch = buf[n++];
+        p_conn->line[p_conn->line_len++] = ch;
+        if (ch == '\n')
+        {
+            complete = 1;
+            break;
+        }
+        if (!conn_line_may_be_command(p_conn))
+            break;
+    }
+    *p_used = n;
+
+    if (!complete && conn_line_may_be_command(p_conn) && p_conn->line_len < CMD_LINE_MAX)
+        return 0;
+
+    p_conn->sniffing = 0;
+    if (complete && conn_line_may_be_command(p_conn))
+    {
+        int command = conn_command(p_conn);
+        if (command)
+            return command == 2;
+    }
+
+    return conn_stage(p_conn, p_conn->line, p_conn->line_len);
+}
+
+static uint64_t frame_get_be(const unsigned char *p, int bytes)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static size_t frame_header(char *buf, unsigned type, uint64_t len)
+{
+    unsigned char *p = (unsigned char *)buf;
+    p[0] = FRAME_MAGIC;
+    p[1] = type;
+    p[2] = p[3] = 0;
+    for (int i = 0; i < 8; i++)
+        p[4 + i] = len >> (56 - 8 * i);
+    return FRAME_HDR_LEN;
+}
+
+// Check a complete header and make room for its payload. Returns 0 when
+// the payload can follow, 1 when the frame is malformed and -1 when there
+// is no memory for it.
+static int conn_frame_start(conn_t *p_conn)
+{
+    unsigned type = p_conn->frame_hdr[1];
+
+    p_conn->frame_flags = frame_get_be(p_conn->frame_hdr + 2, 2);
+    p_conn->frame_len = frame_get_be(p_conn->frame_hdr + 4, 8);
+    if (p_conn->frame_hdr[0] != FRAME_MAGIC)
+        p_conn->frame_error = "bad frame magic";
+    else if (type != FRAME_DATA && type != FRAME_REPLAY)
+        p_conn->frame_error = "unknown frame type";
+    else if (type == FRAME_REPLAY && p_conn->frame_len > 0)
+        p_conn->frame_error = "replay frames carry no payload";
+    else if (p_conn->frame_len > STAGE_MAX)
+        p_conn->frame_error = "frame too large";
+    if (p_conn->frame_error)
+        return 1;
+
+    p_conn->stage_len = 0;
+    p_conn->stage_ns = p_conn->recv_ns;
+    return conn_stage_reserve(p_conn, p_conn->frame_len);
+}
+
+// Framed counterpart of conn_stage(): the header says how long the payload
+// is, so nothing is scanned. Whatever follows a complete frame is held
+// back until that frame has been answered. Returns like conn_ingest().
+static int conn_frame_ingest(conn_t *p_conn, const char *buf, size_t len)
+{
+    if (p_conn->frame_hdr_len < FRAME_HDR_LEN)
+    {
+        size_t take = FRAME_HDR_LEN - p_conn->frame_hdr_len;
+        if (take > len)
+            take = len;
+        memcpy(p_conn->frame_hdr + p_conn->frame_hdr_len, buf, take);
+        p_conn->frame_hdr_len += take;
+        buf += take;
+        len -= take;
+        if (p_conn->frame_hdr_len < FRAME_HDR_LEN)
+            return 0;
+
+        int ret = conn_frame_start(p_conn);
+        if (ret != 0)
+            return ret;
+    }
+
+    size_t take = p_conn->frame_len - p_conn->stage_len;
+    if (take > len)
+        take = len;
+    memcpy(p_conn->stage + p_conn->stage_len, buf, take);
+    p_conn->stage_len += take;
+    buf += take;
+    len -= take;
+    if (p_conn->stage_len < p_conn->frame_len)
+        return 0;
+
+    // A whole frame: store a data payload as one packet
+    if (p_conn->frame_hdr[1] == FRAME_DATA && p_conn->frame_len > 0 &&
+        conn_commit(p_conn->stage, p_conn->frame_len, p_conn->stage_ns) != 0)
+        return -1;
+    p_conn->stage_len = 0;
+    p_conn->frame_hdr_len = 0;
+    p_conn->frame_len = 0;
+
+    if (len > 0)
+    {
+        if (conn_stage_reserve(p_conn, len) != 0)
+            return -1;
+        memcpy(p_conn->stage, buf, len);
+        p_conn->stage_len = len;
+        p_conn->frame_backlog = 1;
+    }
+    return 1;
+}
+
+int conn_ingest(conn_t *p_conn, const char *buf, size_t len)
+{
+    int reply_due = 0;
+
+    conn_touch(p_conn);
+    stats_add(STAT_BYTES_IN, len);
+    p_conn->recv_ns = stats_now();
+
+    if (p_conn->sniffing && p_conn->line_len == 0 && len > 0 && (unsigned char)buf[0] == FRAME_MAGIC)
+    {
+        p_conn->sniffing = 0;
+        p_conn->framed = 1;
+    }
+    if (p_conn->framed)
+        return conn_frame_ingest(p_conn, buf, len);
+
+    if (p_conn->sniffing)
+    {
+        size_t used;
+        reply_due = conn_sniff(p_conn, buf, len, &used);
+        if (reply_due < 0)
+            return -1;
+        buf += used;
+        len -= used;
+        if (len == 0)
+            return reply_due;
+    }
+
+    int committed = conn_stage(p_conn, buf, len);
+    if (committed < 0)
+        return -1;
+    return reply_due || committed;
+}
+
+static void conn_reply_range(conn_t *p_conn)
+{
+    // Held-back bytes of a connection that ended mid-line are plain data
+    if (p_conn->sniffing)
+    {
+        p_conn->sniffing = 0;
+        if (p_conn->line_len > 0)
+            conn_stage(p_conn, p_conn->line, p_conn->line_len);
+    }
+    // So is a packet still missing its newline when the last reply starts;
+    // a persistent connection keeps it for the bytes still to come
+    if (p_conn->stage_len > 0 && !p_conn->framed && (!p_conn->persist || p_conn->eof))
+        conn_stage_commit(p_conn);
+
+    p_conn->buf_len = 0;
+    p_conn->buf_sent = 0;
+    p_conn->reply_ns = stats_now();
+    if (p_conn->framed)
+    {
+        off_t start = store_start();
+        off_t end = store_size();
+        p_conn->reply_off = 0;
+        p_conn->reply_end = 0;
+        if (p_conn->frame_error)
+        {
+            size_t msg_len = strlen(p_conn->frame_error);
+            p_conn->buf_len = frame_header(p_conn->buffer, FRAME_ERROR, msg_len);
+            memcpy(p_conn->buffer + p_conn->buf_len, p_conn->frame_error, msg_len);
+            p_conn->buf_len += msg_len;
+        }
+        else if (p_conn->frame_flags & FRAME_F_ACK)
+            p_conn->buf_len = frame_header(p_conn->buffer, FRAME_ACK, 0);
+        else
+        {
+            p_conn->reply_off = start;
+            p_conn->reply_end = end;
+            p_conn->buf_len = frame_header(p_conn->buffer, FRAME_REPLY, end - start);
+        }
+        return;
+    }
+    if (p_conn->stats)
+    {
+        p_conn->reply_off = 0;
+        p_conn->reply_end = 0;
+        p_conn->buf_len = stats_format(p_conn->buffer, BUF_SIZE);
+        return;
+    }
+    if (p_conn->compress)
+    {
+        // Frames cover what is committed now
+        p_conn->reply_off = store_start();
+        p_conn->reply_end = store_size();
+        return;
+    }
+    if (p_conn->persist)
+    {
+        // Replies on a shared connection must say where they end
+        off_t start = store_start();
+        off_t end = store_size();
+        p_conn->packets++;
+        p_conn->reply_off = p_conn->persist == PERSIST_ACK ? 0 : start;
+        p_conn->reply_end = p_conn->persist == PERSIST_ACK ? 0 : end;
+        if (p_conn->persist == PERSIST_ACK)
+            p_conn->buf_len = snprintf(p_conn->buffer, BUF_SIZE, CMD_ACK ":%llu\n",
+                                       (unsigned long long)p_conn->packets);
+        else
+            p_conn->buf_len = snprintf(p_conn->buffer, BUF_SIZE, CMD_LENGTH ":%lld\n",
+                                       (long long)(end - start));
+        return;
+    }
+    if (p_conn->seek)
+    {
+        p_conn->reply_off = p_conn->seek_off < 0 ? 0 : p_conn->seek_off;
+        p_conn->reply_end = p_conn->seek_off < 0 ? 0 : -1;
+        if (p_conn->seek_off < 0)
+            p_conn->buf_len = snprintf(p_conn->buffer, BUF_SIZE, CMD_ERROR ":no such position\n");
+        return;
+    }
+    if (!p_conn->resume)
+    {
+        p_conn->reply_off = store_start();
+        p_conn->reply_end = -1;
+        return;
+    }
+
+    // A token from another store generation, or from the future, is stale;
+    // one from before the retained data gets what is left
+    uint64_t generation = store_generation();
+    off_t start = store_start();
+    off_t end = store_size();
+    off_t from = p_conn->resume_off;
+    if (p_conn->resume_gen != generation || from > end || from < start)
+        from = start;
+
+    p_conn->reply_off = from;
+    p_conn->reply_end = end;
+    p_conn->buf_len = snprintf(p_conn->buffer, BUF_SIZE, CMD_TOKEN ":%llu:%lld\n",
+                               (unsigned long long)generation, (long long)end);
+}
+
+void conn_begin_reply(conn_t *p_conn)
+{
+    conn_reply_range(p_conn);
+    // Replies that would copy the store share one image of it instead of
+    // each reading it again; bytes appended after it are read as usual
+    if (p_conn->copy_reply && !p_conn->compress && p_conn->reply_end != 0)
+        p_conn->p_snap = snapshot_get();
+}
+
+// n more bytes of the current compressed block went out
+static void conn_zblock_advance(conn_t *p_conn, size_t n)
+{
+    p_conn->zblock_sent += n;
+    if (p_conn->zblock_sent == p_conn->p_zblock->z_len)
+    {
+        p_conn->reply_off += p_conn->p_zblock->raw_len;
+        zblock_put(p_conn->p_zblock);
+        p_conn->p_zblock = NULL;
+    }
+}
+
+ssize_t conn_frame_read(conn_t *p_conn, char *buf, size_t len)
+{
+    if (p_conn->p_zblock)
+    {
+        size_t n = p_conn->p_zblock->z_len - p_conn->zblock_sent;
+        if (n > len)
+            n = len;
+        memcpy(buf, p_conn->p_zblock->data + p_conn->zblock_sent, n);
+        conn_zblock_advance(p_conn, n);
+        return n;
+    }
+    if (p_conn->raw_left > 0)
+    {
+        ssize_t n = store_read(p_conn->reply_off, buf, len < p_conn->raw_left ? len : p_conn->raw_left);
+        if (n <= 0)
+            return -1;
+        p_conn->reply_off += n;
+        p_conn->raw_left -= n;
+        return n;
+    }
+    if (p_conn->reply_off >= p_conn->reply_end)
+        return 0;
+
+    // A whole sealed block goes compressed; anything else, such as the
+    // unsealed tail or a block retention cut into, goes raw up to the next
+    // block boundary
+    off_t in_block = p_conn->reply_off % ZBLOCK_SIZE;
+    if (in_block == 0 && p_conn->reply_end - p_conn->reply_off >= ZBLOCK_SIZE &&
+        zblock_get(p_conn->reply_off / ZBLOCK_SIZE, &p_conn->p_zblock) == 0)
+    {
+        p_conn->zblock_sent = 0;
+        return snprintf(buf, len, CMD_ZBLOCK ":%zu:%zu\n", p_conn->p_zblock->raw_len, p_conn->p_zblock->z_len);
+    }
+    p_conn->raw_left = ZBLOCK_SIZE - in_block;
+    if ((off_t)p_conn->raw_left > p_conn->reply_end - p_conn->reply_off)
+        p_conn->raw_left = p_conn->reply_end - p_conn->reply_off;
+    return snprintf(buf, len, CMD_RAW ":%zu\n", p_conn->raw_left);
+}
+
+int conn_end_reply(conn_t *p_conn)
+{
+    stats_record(STAT_PHASE_REPLAY, stats_now() - p_conn->reply_ns);
+    snapshot_put(p_conn->p_snap);
+    p_conn->p_snap = NULL;
+    if (p_conn->framed)
+    {
+        p_conn->buf_len = 0;
+        p_conn->buf_sent = 0;
+        if (p_conn->frame_error)
+            return -1;
+        if (!p_conn->frame_backlog)
+            return p_conn->eof ? -1 : 0;
+
+        // Input held back behind the frame just answered goes first
+        char *backlog = p_conn->stage;
+        size_t backlog_len = p_conn->stage_len;
+        size_t backlog_cap = p_conn->stage_cap;
+        p_conn->stage = NULL;
+        p_conn->stage_len = 0;
+        p_conn->stage_cap = 0;
+        p_conn->frame_backlog = 0;
+        int ret = conn_frame_ingest(p_conn, backlog, backlog_len);
+        buf_pool_put(backlog, backlog_cap);
+        if (ret == 0 && p_conn->eof)
+            return -1;
+        return ret;
+    }
+    if (!p_conn->persist)
+        return -1;
+
+    p_conn->buf_len = 0;
+    p_conn->buf_sent = 0;
+
+    // Pipelined packets already staged are answered before reading more
+    char *nl = p_conn->stage_len > 0 ? memchr(p_conn->stage, '\n', p_conn->stage_len) : NULL;
+    if (nl)
+    {
+        size_t take = nl - p_conn->stage + 1;
+        if (conn_commit(p_conn->stage, take, p_conn->stage_ns) != 0)
+            return -1;
+        p_conn->stage_len -= take;
+        memmove(p_conn->stage, p_conn->stage + take, p_conn->stage_len);
+        return 1;
+    }
+    if (p_conn->eof)
+        return p_conn->stage_len > 0 ? 1 : -1;
+    return 0;
+}
+
+int conn_peer_closed(conn_t *p_conn)
+{
+    p_conn->eof = 1;
+    // Whatever an evicted peer left unfinished is dropped
+    if (atomic_load(&p_conn->timed_out))
+        return -1;
+    // Every complete frame has been answered; a partial one is dropped
+    if (p_conn->framed)
+        return -1;
+    // A persistent connection owes a reply only to an unfinished packet
+    if (p_conn->persist && p_conn->stage_len == 0)
+        return -1;
+    return 1;
+}
+
+// Reply sent: receive again, answer the next pipelined packet or finish
+static void conn_next(conn_t *p_conn)
+{
+    switch (conn_end_reply(p_conn))
+    {
+    case 1:
+        conn_begin_reply(p_conn);
+        p_conn->state = CONN_REPLY;
+        break;
+    case 0:
+        p_conn->state = CONN_RECV;
+        break;
+    default:
+        p_conn->state = CONN_DONE;
+        break;
+    }
+}
+
+// A socket call failed for good
+static void conn_fail(conn_t *p_conn)
+{
+    stats_add(STAT_ERRORS, 1);
+    p_conn->state = CONN_DONE;
+}
+
+// How much of the reply may be fetched next, capped at max
+static size_t conn_reply_window(const conn_t *p_conn, size_t max)
+{
+    if (p_conn->reply_end < 0)
+        return max;
+    if (p_conn->reply_off >= p_conn->reply_end)
+        return 0;
+    if ((off_t)max > p_conn->reply_end - p_conn->reply_off)
+        return p_conn->reply_end - p_conn->reply_off;
+    return max;
+}
+
+conn_io_t conn_process(conn_t *p_conn)
+{
+    ssize_t n;
+
+    for (;;)
+    {
+        switch (p_conn->state)
+        {
+        case CONN_RECV:
+            if (p_conn->framed && p_conn->frame_hdr_len == FRAME_HDR_LEN)
+            {
+                // Scatter the rest of the payload straight into its staging
+                // buffer and anything after it into buffer
+                size_t want = p_conn->frame_len - p_conn->stage_len;
+                struct iovec iov[2] = {
+                    {.iov_base = p_conn->stage + p_conn->stage_len, .iov_len = want},
+                    {.iov_base = p_conn->buffer, .iov_len = BUF_SIZE},
+                };
+                n = readv(p_conn->client_fd, iov, 2);
+                if (n > 0)
+                {
+                    size_t direct = (size_t)n < want ? (size_t)n : want;
+                    p_conn->stage_len += direct;
+                    stats_add(STAT_BYTES_IN, direct);
+                    p_conn->buf_len = n - direct;
+                    p_conn->state = CONN_APPEND;
+                    break;
+                }
+            }
+            else
+                n = recv(p_conn->client_fd, p_conn->buffer, BUF_SIZE, 0);
+            if (n > 0)
+            {
+                p_conn->buf_len = n;
+                p_conn->state = CONN_APPEND;
+            }
+            else if (n == 0)
+            {
+                // Peer shut down its side without a newline: reply anyway
+                if (conn_peer_closed(p_conn) > 0)
+                {
+                    conn_begin_reply(p_conn);
+                    p_conn->state = CONN_REPLY;
+                }
+                else
+                    p_conn->state = CONN_DONE;
+            }
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return CONN_WANT_READ;
+            else if (errno != EINTR)
+                conn_fail(p_conn);
+            break;
+
+        case CONN_APPEND:
+            switch (conn_ingest(p_conn, p_conn->buffer, p_conn->buf_len))
+            {
+            case 1:
+                conn_begin_reply(p_conn);
+                p_conn->state = CONN_REPLY;
+                break;
+            case 0:
+                p_conn->state = CONN_RECV;
+                break;
+            default:
+                p_conn->state = CONN_DONE;
+                break;
+            }
+            break;
+
+        case CONN_REPLY:
+            if (p_conn->buf_sent < p_conn->buf_len)
+            {
+                n = send(p_conn->client_fd, p_conn->buffer + p_conn->buf_sent,
+                         p_conn->buf_len - p_conn->buf_sent, MSG_NOSIGNAL);
+                if (n >= 0)
+                {
+                    p_conn->buf_sent += n;
+                    conn_sent(p_conn, n);
+                }
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return CONN_WANT_WRITE;
+                else if (errno != EINTR)
+                    conn_fail(p_conn);
+                break;
+            }
+
+            if (conn_reply_window(p_conn, 1) == 0)
+            {
+                conn_next(p_conn);
+                break;
+            }
+
+            if (p_conn->compress)
+            {
+                // Cached blocks go from the cache straight to the socket
+                if (p_conn->p_zblock)
+                {
+                    n = send(p_conn->client_fd, p_conn->p_zblock->data + p_conn->zblock_sent,
+                             p_conn->p_zblock->z_len - p_conn->zblock_sent, MSG_NOSIGNAL);
+                    if (n >= 0)
+                    {
+                        conn_zblock_advance(p_conn, n);
+                        conn_sent(p_conn, n);
+                    }
+                    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return CONN_WANT_WRITE;
+                    else if (errno != EINTR)
+                        conn_fail(p_conn);
+                    break;
+                }
+                n = conn_frame_read(p_conn, p_conn->buffer, BUF_SIZE);
+                if (n > 0)
+                {
+                    p_conn->buf_len = n;
+                    p_conn->buf_sent = 0;
+                }
+                else if (n == 0)
+                    conn_next(p_conn);
+                else
+                    p_conn->state = CONN_DONE;
+                break;
+            }
+
+            if (!p_conn->copy_reply)
+            {
+                n = store_send(p_conn->client_fd, p_conn->reply_off,
+                               conn_reply_window(p_conn, REPLY_CHUNK));
+                if (n > 0)
+                {
+                    p_conn->reply_off += n;
+                    conn_sent(p_conn, n);
+                }
+                else if (n == 0)
+                    conn_next(p_conn);
+                else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    return CONN_WANT_WRITE;
+                else if (errno == EOPNOTSUPP)
+                    p_conn->copy_reply = 1;
+                else if (errno != EINTR)
+                    conn_fail(p_conn);
+                break;
+            }
+
+            if (p_conn->p_snap)
+            {
+                size_t len = conn_reply_window(p_conn, REPLY_CHUNK);
+                const char *p_data = snapshot_data(p_conn->p_snap, p_conn->reply_off, &len);
+                if (p_data)
+                {
+                    n = send(p_conn->client_fd, p_data, len, MSG_NOSIGNAL);
+                    if (n >= 0)
+                    {
+                        p_conn->reply_off += n;
+                        conn_sent(p_conn, n);
+                    }
+                    else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                        return CONN_WANT_WRITE;
+                    else if (errno != EINTR)
+                        conn_fail(p_conn);
+                    break;
+                }
+            }
+
+            n = store_read(p_conn->reply_off, p_conn->buffer, conn_reply_window(p_conn, BUF_SIZE));
+            if (n > 0)
+            {
+                p_conn->reply_off += n;
+                p_conn->buf_len = n;
+                p_conn->buf_sent = 0;
+            }
+            else if (n == 0)
+                conn_next(p_conn);
+            else
+                p_conn->state = CONN_DONE;
+            break;
+
+        case CONN_DONE:
+            return CONN_CLOSE;
+        }
+    }
+}
+
+void conn_close(conn_t *p_conn)
+{
+    timer_cancel(&p_conn->idle_timer);
+    zblock_put(p_conn->p_zblock);
+    p_conn->p_zblock = NULL;
+    snapshot_put(p_conn->p_snap);
+    p_conn->p_snap = NULL;
+    buf_pool_put(p_conn->stage, p_conn->stage_cap);
+    p_conn->stage = NULL;
+    close(p_conn->client_fd);
+    log_conn(LOG_INFO, "Closed connection from %s", p_conn->ipstr);
+}
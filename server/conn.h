@@ -0,0 +1,193 @@
+#ifndef CONN_H
+#define CONN_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+#include "aesdsocket.h"
+#include "timer.h"
+#include "zblock.h"
+#include "snapshot.h"
+
+// A connection may open with one control line instead of data. Control
+// lines start with CMD_PREFIX and are never stored.
+#define CMD_PREFIX "AESD"
+
+// On stop every driver drains: nothing new is accepted, clients already
+// connected get CONN_DRAIN_GRACE_MS to finish, and those still connected
+// then are kicked to end of file and get their final reply as usual. The
+// drain gives up after CONN_DRAIN_MS.
+#define CONN_DRAIN_GRACE_MS 500
+#define CONN_DRAIN_MS 5000
+#define CMD_LINE_MAX 128
+
+// Delta replay: "AESDRESUME:<generation>:<offset>\n" (or a bare
+// "AESDRESUME\n" on the first visit) asks for only the bytes after offset.
+// Such replies start with "AESDTOKEN:<generation>:<end>\n", the token to
+// present next time.
+#define CMD_RESUME "AESDRESUME"
+#define CMD_TOKEN "AESDTOKEN"
+
+// Positional read: "AESDCHAR_IOCSEEKTO:<record>,<byte>\n" replies with the
+// store from byte of record onwards, both counted from 0. A position that
+// does not exist gets a single "AESDERROR:..." line instead.
+#define CMD_SEEKTO "AESDCHAR_IOCSEEKTO"
+#define CMD_ERROR "AESDERROR"
+
+// Persistent connection: after "AESDPERSIST\n" the connection stays open
+// and answers every packet, pipelined ones included, in order. Each reply
+// is "AESDLEN:<n>\n" followed by the n bytes the store retains. With
+// "AESDPERSIST:ack\n" each packet only gets "AESDACK:<seq>\n", counting
+// this connection's packets from 1.
+#define CMD_PERSIST "AESDPERSIST"
+#define CMD_LENGTH "AESDLEN"
+#define CMD_ACK "AESDACK"
+
+// Telemetry: "AESDSTATS\n" replies with counters and per-phase latency
+// percentiles as "AESDSTATS:..." lines instead of the store
+#define CMD_STATS "AESDSTATS"
+
+// Compressed replay: after "AESDCOMPRESS\n" the reply is a series of
+// frames. "AESDZBLOCK:<raw_len>:<z_len>\n" is followed by z_len bytes of a
+// zlib stream that expands to raw_len bytes of the store, and
+// "AESDRAW:<len>\n" by len bytes as stored. Sealed blocks come compressed
+// when the server can compress; everything else comes raw.
+#define CMD_COMPRESS "AESDCOMPRESS"
+#define CMD_ZBLOCK "AESDZBLOCK"
+#define CMD_RAW "AESDRAW"
+
+// Framed protocol: a connection whose first byte is FRAME_MAGIC, which no
+// text starts with, speaks in frames instead of lines. Every frame has a
+// FRAME_HDR_LEN byte header: the magic, a type byte, 16 bits of flags and
+// a 64-bit payload length, both big-endian, and then the payload, which
+// may be binary. FRAME_DATA appends its payload as one packet and
+// FRAME_REPLAY appends nothing; each gets a FRAME_REPLY with the retained
+// store, or a bare FRAME_ACK if it set FRAME_F_ACK. Frames are answered in
+// order and the connection stays open. A malformed frame gets FRAME_ERROR
+// with a message and ends the connection.
+#define FRAME_MAGIC 0xAE
+#define FRAME_HDR_LEN 12
+#define FRAME_DATA 0x01
+#define FRAME_REPLAY 0x02
+#define FRAME_REPLY 0x81
+#define FRAME_ACK 0x82
+#define FRAME_ERROR 0x83
+#define FRAME_F_ACK 0x0001
+
+typedef enum
+{
+    PERSIST_OFF,
+    PERSIST_FULL,
+    PERSIST_ACK
+} persist_mode_t;
+
+// Per-connection state machine shared by every client handling mode.
+// A connection stages received bytes until a newline, commits the complete
+// packet to the store with a single append and then replies with the full
+// store content. Persistent connections go back to receiving afterwards.
+typedef enum
+{
+    CONN_RECV,
+    CONN_APPEND,
+    CONN_REPLY,
+    CONN_DONE
+} conn_state_t;
+
+// What the connection needs next from its driver
+typedef enum
+{
+    CONN_WANT_READ,
+    CONN_WANT_WRITE,
+    CONN_CLOSE
+} conn_io_t;
+
+typedef struct
+{
+    int client_fd;
+    char ipstr[INET6_ADDRSTRLEN];
+    conn_state_t state;
+    int copy_reply;
+    int sniffing;
+    int resume;
+    uint64_t resume_gen;
+    off_t resume_off;
+    persist_mode_t persist;
+    uint64_t packets;
+    int eof;
+    int stats;
+    int compress;
+    int framed;
+    unsigned char frame_hdr[FRAME_HDR_LEN];
+    size_t frame_hdr_len;
+    uint16_t frame_flags;
+    uint64_t frame_len; // payload of the frame being received, staged in stage
+    int frame_backlog;  // stage holds input after a frame still unanswered
+    const char *frame_error;
+    zblock_t *p_zblock; // compressed block being sent, with a reference
+    size_t zblock_sent;
+    size_t raw_left; // bytes still due in the current raw frame
+    int seek;
+    off_t seek_off; // -1: the requested position does not exist
+    off_t reply_off;
+    off_t reply_end; // -1: run to the end of the store, however far it grows
+    snapshot_t *p_snap; // shared image the reply is sent from, or NULL
+    size_t line_len;
+    char line[CMD_LINE_MAX];
+    char *stage; // packet bytes not yet committed, from buf_pool
+    size_t stage_len;
+    size_t stage_cap;
+    uint64_t recv_ns;  // stats_now() of the latest receive
+    uint64_t stage_ns; // ...of the one that started the staged packet
+    uint64_t reply_ns;
+    size_t buf_len;
+    size_t buf_sent;
+    tw_timer_t idle_timer;
+    _Atomic uint64_t last_active; // timer_now() of the last socket progress
+    _Atomic int timed_out;
+    char buffer[BUF_SIZE];
+} conn_t;
+
+// Connections without socket progress for this long are shut down, so
+// stalled or trickling peers cannot hold a thread or slot. 0 disables it.
+void conn_set_idle_timeout(unsigned secs);
+
+void conn_init(conn_t *p_conn, int client_fd, const char *ipstr);
+
+// Record socket progress for the idle timeout
+void conn_touch(conn_t *p_conn);
+
+// Account for n reply bytes that went out on the socket
+void conn_sent(conn_t *p_conn, size_t n);
+
+// Run received bytes through the protocol, independent of how they were
+// read. Returns 1 when a reply is due, 0 when more input is needed and -1
+// when the store rejected the data.
+int conn_ingest(conn_t *p_conn, const char *buf, size_t len);
+
+// Set up the reply range. A reply header, if any, is left in buffer[0..buf_len).
+// Copying replies also get a reference to the shared store snapshot.
+void conn_begin_reply(conn_t *p_conn);
+
+// Produce the next piece of a compressed reply into buf, which must hold
+// at least a frame header, and advance the reply. Returns the length, 0
+// once the reply is complete or -1 on a store error.
+ssize_t conn_frame_read(conn_t *p_conn, char *buf, size_t len);
+
+// The reply has been sent in full. Returns 1 when the next reply is due
+// right away (a pipelined packet was already received), 0 when more input
+// is needed and -1 when the connection is finished.
+int conn_end_reply(conn_t *p_conn);
+
+// The peer shut down its side. Returns 1 when a final reply is due and -1
+// when the connection is finished, which it always is after an idle timeout.
+int conn_peer_closed(conn_t *p_conn);
+
+// Advance the state machine as far as the socket allows. With a blocking
+// socket this runs the whole exchange; with a non-blocking socket it stops
+// at EAGAIN and reports which readiness event to wait for.
+conn_io_t conn_process(conn_t *p_conn);
+
+// Cancels the idle timer before anything is released
+void conn_close(conn_t *p_conn);
+
+#endif /* CONN_H */
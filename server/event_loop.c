@@ -0,0 +1,257 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "queue.h"
+#include "conn.h"
+#include "event_loop.h"
+#include "log_ring.h"
+#include "slab.h"
+#include "stats.h"
+
+#define MAX_EVENTS 256
+
+// Connection tracked by the event loop
+typedef struct loop_conn_s loop_conn_t;
+struct loop_conn_s
+{
+    conn_t conn;
+    uint32_t events;
+    uint64_t accepted_ns; // stats_now() at accept(), 0 once first dispatched
+    LIST_ENTRY(loop_conn_s) entries;
+};
+
+LIST_HEAD(loop_conn_head, loop_conn_s);
+
+static int set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1)
+        return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// One process holding thousands of sockets needs more than the default soft limit
+static void raise_fd_limit(void)
+{
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &rl) != 0)
+            syslog(LOG_WARNING, "setrlimit(RLIMIT_NOFILE) failed");
+    }
+}
+
+static void loop_conn_free(int epoll_fd, slab_cache_t *p_cache, loop_conn_t *p_lc)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, p_lc->conn.client_fd, NULL);
+    LIST_REMOVE(p_lc, entries);
+    conn_close(&p_lc->conn);
+    slab_free(p_cache, p_lc);
+}
+
+// Run the connection state machine and re-arm for whatever it waits on next
+static void loop_conn_dispatch(int epoll_fd, slab_cache_t *p_cache, loop_conn_t *p_lc)
+{
+    uint32_t wanted;
+
+    if (p_lc->accepted_ns)
+    {
+        stats_record(STAT_PHASE_ACCEPT, stats_now() - p_lc->accepted_ns);
+        p_lc->accepted_ns = 0;
+    }
+
+    switch (conn_process(&p_lc->conn))
+    {
+    case CONN_WANT_READ:
+        wanted = EPOLLIN;
+        break;
+    case CONN_WANT_WRITE:
+        wanted = EPOLLOUT;
+        break;
+    default:
+        loop_conn_free(epoll_fd, p_cache, p_lc);
+        return;
+    }
+
+    if (wanted != p_lc->events)
+    {
+        struct epoll_event ev = {.events = wanted, .data.ptr = p_lc};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, p_lc->conn.client_fd, &ev) != 0)
+        {
+            syslog(LOG_ERR, "epoll_ctl(MOD) failed");
+            loop_conn_free(epoll_fd, p_cache, p_lc);
+            return;
+        }
+        p_lc->events = wanted;
+    }
+}
+
+static void loop_accept(int epoll_fd, int listen_fd, int *p_spare_fd, slab_cache_t *p_cache,
+                        struct loop_conn_head *p_head)
+{
+    for (;;)
+    {
+        struct sockaddr_storage client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+
+        int client_fd = accept4(listen_fd, (struct sockaddr *)&client_addr, &client_addr_len,
+                                SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && *p_spare_fd >= 0)
+            {
+                // Out of descriptors: accept and drop the peer so the
+                // level-triggered listen socket does not spin
+                log_conn(LOG_ERR, "Out of file descriptors, dropping connection");
+                close(*p_spare_fd);
+                client_fd = accept(listen_fd, NULL, NULL);
+                if (client_fd >= 0)
+                    close(client_fd);
+                *p_spare_fd = open("/dev/null", O_RDONLY);
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !stop_requested)
+                perror("accept failed");
+            return;
+        }
+
+        char ipstr[INET6_ADDRSTRLEN];
+        if (get_client_ip(client_addr, ipstr, INET6_ADDRSTRLEN) != 0)
+        {
+            close(client_fd);
+            continue;
+        }
+
+        log_conn(LOG_INFO, "Accepted connection from %s", ipstr);
+
+        loop_conn_t *p_lc = slab_alloc(p_cache);
+        if (!p_lc)
+        {
+            syslog(LOG_ERR, "Memory allocation failed");
+            close(client_fd);
+            continue;
+        }
+
+        conn_init(&p_lc->conn, client_fd, ipstr);
+        p_lc->events = EPOLLIN;
+        p_lc->accepted_ns = stats_now();
+
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = p_lc};
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) != 0)
+        {
+            syslog(LOG_ERR, "epoll_ctl(ADD) failed");
+            close(client_fd);
+            slab_free(p_cache, p_lc);
+            continue;
+        }
+        LIST_INSERT_HEAD(p_head, p_lc, entries);
+    }
+}
+
+int event_loop_run(int listen_fd)
+{
+    raise_fd_limit();
+
+    if (set_nonblocking(listen_fd) != 0)
+    {
+        syslog(LOG_ERR, "Failed to make listening socket non-blocking");
+        return -1;
+    }
+
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0)
+    {
+        syslog(LOG_ERR, "epoll_create1() failed");
+        return -1;
+    }
+
+    // The listening socket is tagged with a NULL pointer
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) != 0)
+    {
+        syslog(LOG_ERR, "epoll_ctl(ADD) failed for listening socket");
+        close(epoll_fd);
+        return -1;
+    }
+
+    // Connection contexts come from a slab cache so accept storms reuse
+    // memory instead of going through malloc for every client
+    slab_cache_t *p_cache = slab_create(sizeof(loop_conn_t));
+    if (!p_cache)
+    {
+        syslog(LOG_ERR, "Failed to create connection cache");
+        close(epoll_fd);
+        return -1;
+    }
+
+    int spare_fd = open("/dev/null", O_RDONLY);
+    struct loop_conn_head conn_list;
+    LIST_INIT(&conn_list);
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!stop_requested)
+    {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "epoll_wait() failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == NULL)
+                loop_accept(epoll_fd, listen_fd, &spare_fd, p_cache, &conn_list);
+            else
+                loop_conn_dispatch(epoll_fd, p_cache, events[i].data.ptr);
+        }
+    }
+
+    loop_conn_t *p_lc;
+    loop_conn_t *p_tmp_lc;
+
+    // Drain, see CONN_DRAIN_MS
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, listen_fd, NULL);
+    uint64_t kick = timer_now() + CONN_DRAIN_GRACE_MS / TIMER_TICK_MS;
+    uint64_t deadline = timer_now() + CONN_DRAIN_MS / TIMER_TICK_MS;
+    while (!LIST_EMPTY(&conn_list) && timer_now() < deadline)
+    {
+        if (kick && timer_now() >= kick)
+        {
+            LIST_FOREACH(p_lc, &conn_list, entries)
+            {
+                shutdown(p_lc->conn.client_fd, SHUT_RD);
+            }
+            kick = 0;
+        }
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, TIMER_TICK_MS);
+        if (n < 0 && errno != EINTR)
+            break;
+        for (int i = 0; i < n; i++)
+            loop_conn_dispatch(epoll_fd, p_cache, events[i].data.ptr);
+    }
+
+    LIST_FOREACH_SAFE(p_lc, &conn_list, entries, p_tmp_lc)
+    {
+        loop_conn_free(epoll_fd, p_cache, p_lc);
+    }
+    slab_destroy(p_cache);
+
+    if (spare_fd >= 0)
+        close(spare_fd);
+    close(epoll_fd);
+    return 0;
+}
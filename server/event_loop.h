@@ -0,0 +1,8 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+// Serve every client from the calling thread with a non-blocking epoll loop.
+// Returns when stop_requested is set, after closing all open connections.
+int event_loop_run(int listen_fd);
+
+#endif /* EVENT_LOOP_H */
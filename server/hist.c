@@ -0,0 +1,38 @@
+#include "hist.h"
+
+size_t hist_bucket(uint64_t value)
+{
+    if (value < HIST_LINEAR)
+        return value;
+    if (value >> HIST_MAX_BITS)
+        value = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+
+    int msb = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1);
+    return HIST_LINEAR + (msb - HIST_SUB_BITS - 1) * HIST_SUB + sub;
+}
+
+uint64_t hist_bucket_top(size_t bucket)
+{
+    if (bucket < HIST_LINEAR)
+        return bucket;
+
+    int msb = (bucket - HIST_LINEAR) / HIST_SUB + HIST_SUB_BITS + 1;
+    uint64_t sub = (bucket - HIST_LINEAR) % HIST_SUB;
+    uint64_t width = (uint64_t)1 << (msb - HIST_SUB_BITS);
+    return (HIST_SUB + sub) * width + width - 1;
+}
+
+uint64_t hist_percentile(const uint64_t *p_counts, uint64_t total, unsigned permille)
+{
+    uint64_t rank = (total * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += p_counts[i];
+        if (seen >= rank && seen > 0)
+            return hist_bucket_top(i);
+    }
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef HIST_H
+#define HIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear latency buckets: values below HIST_LINEAR get a bucket each,
+// above that every power of two is split into HIST_SUB buckets, so a
+// bucket's top is within 12.5% of anything in it. Values are clamped
+// below 2^HIST_MAX_BITS.
+#define HIST_SUB_BITS 3
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_LINEAR (2 * HIST_SUB)
+#define HIST_MAX_BITS 40
+#define HIST_BUCKETS (HIST_LINEAR + (HIST_MAX_BITS - HIST_SUB_BITS - 1) * HIST_SUB)
+
+size_t hist_bucket(uint64_t value);
+
+// Highest value that lands in bucket
+uint64_t hist_bucket_top(size_t bucket);
+
+// The bucket top at or below which permille of the total samples fall
+uint64_t hist_percentile(const uint64_t *p_counts, uint64_t total, unsigned permille);
+
+#endif /* HIST_H */
@@ -0,0 +1,254 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "log_ring.h"
+
+#define LOG_RING_SLOTS 512
+#define LOG_LINE_MAX 160
+#define LOG_RINGS_MAX 256
+#define LOG_FLUSH_MS 100
+
+// Connection messages allowed per second over all threads
+#define LOG_CONN_RATE_MAX 1000
+
+typedef struct
+{
+    int priority;
+    char text[LOG_LINE_MAX];
+} log_entry_t;
+
+// Single-producer/single-consumer ring: the owning thread advances head,
+// the writer advances tail. They live on separate cache lines.
+typedef struct
+{
+    _Atomic uint64_t head;
+    char pad[64 - sizeof(uint64_t)];
+    _Atomic uint64_t tail;
+    log_entry_t entries[LOG_RING_SLOTS];
+} __attribute__((aligned(64))) log_ring_t;
+
+static _Atomic(log_ring_t *) rings[LOG_RINGS_MAX];
+static _Atomic int ring_count;
+static _Thread_local log_ring_t *p_local_ring;
+
+static int log_level = LOG_DEBUG;
+static unsigned log_sample = 1;
+static _Atomic uint64_t sample_seq;
+static _Atomic int64_t rate_second;
+static _Atomic unsigned rate_count;
+static _Atomic uint64_t suppressed;
+static _Atomic uint64_t dropped;
+
+static pthread_t writer_tid;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond;
+static int writer_running;
+static int writer_closing;
+
+static const struct
+{
+    const char *name;
+    int level;
+} level_names[] = {
+    {"err", LOG_ERR},
+    {"warning", LOG_WARNING},
+    {"notice", LOG_NOTICE},
+    {"info", LOG_INFO},
+    {"debug", LOG_DEBUG},
+};
+
+static log_ring_t *log_ring_local(void)
+{
+    if (p_local_ring)
+        return p_local_ring;
+
+    int index = atomic_fetch_add(&ring_count, 1);
+    if (index >= LOG_RINGS_MAX)
+    {
+        atomic_fetch_sub(&ring_count, 1);
+        return NULL;
+    }
+
+    log_ring_t *p_ring = aligned_alloc(64, sizeof(log_ring_t));
+    if (p_ring)
+    {
+        atomic_init(&p_ring->head, 0);
+        atomic_init(&p_ring->tail, 0);
+    }
+    // A failed allocation leaves the slot NULL, which the writer skips
+    atomic_store_explicit(&rings[index], p_ring, memory_order_release);
+    p_local_ring = p_ring;
+    return p_ring;
+}
+
+// Hand every queued line to syslog
+static void log_ring_drain(void)
+{
+    int count = atomic_load(&ring_count);
+
+    for (int i = 0; i < count; i++)
+    {
+        log_ring_t *p_ring = atomic_load_explicit(&rings[i], memory_order_acquire);
+        if (!p_ring)
+            continue;
+
+        uint64_t tail = atomic_load_explicit(&p_ring->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&p_ring->head, memory_order_acquire);
+        for (; tail != head; tail++)
+        {
+            log_entry_t *p_entry = &p_ring->entries[tail % LOG_RING_SLOTS];
+            syslog(p_entry->priority, "%s", p_entry->text);
+        }
+        atomic_store_explicit(&p_ring->tail, tail, memory_order_release);
+    }
+
+    uint64_t n = atomic_exchange(&suppressed, 0);
+    if (n > 0)
+        syslog(LOG_WARNING, "Suppressed %llu connection log messages over the rate limit",
+               (unsigned long long)n);
+    n = atomic_exchange(&dropped, 0);
+    if (n > 0)
+        syslog(LOG_WARNING, "Dropped %llu connection log messages, log ring full", (unsigned long long)n);
+}
+
+static void *log_writer_thread(void *arg)
+{
+    (void)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&writer_mutex);
+    while (!writer_closing)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&writer_cond, &writer_mutex, &deadline);
+
+        pthread_mutex_unlock(&writer_mutex);
+        log_ring_drain();
+        pthread_mutex_lock(&writer_mutex);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+    return NULL;
+}
+
+// Nonzero when this message fits in the current second's budget
+static int log_rate_allow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+
+    int64_t second = atomic_load_explicit(&rate_second, memory_order_relaxed);
+    if (ts.tv_sec != second &&
+        atomic_compare_exchange_strong(&rate_second, &second, (int64_t)ts.tv_sec))
+        atomic_store(&rate_count, 0);
+
+    return atomic_fetch_add_explicit(&rate_count, 1, memory_order_relaxed) < LOG_CONN_RATE_MAX;
+}
+
+int log_ring_start(int level, unsigned sample)
+{
+    log_level = level;
+    log_sample = sample > 0 ? sample : 1;
+    setlogmask(LOG_UPTO(level));
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&writer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    writer_closing = 0;
+    if (pthread_create(&writer_tid, NULL, log_writer_thread, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to create log writer thread, logging synchronously");
+        pthread_cond_destroy(&writer_cond);
+        return -1;
+    }
+    writer_running = 1;
+    return 0;
+}
+
+void log_ring_stop(void)
+{
+    if (!writer_running)
+        return;
+
+    pthread_mutex_lock(&writer_mutex);
+    writer_closing = 1;
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_mutex);
+    pthread_join(writer_tid, NULL);
+    pthread_cond_destroy(&writer_cond);
+    writer_running = 0;
+
+    // Nobody logs any more; whatever was queued since the last pass goes out
+    log_ring_drain();
+    int count = atomic_exchange(&ring_count, 0);
+    for (int i = 0; i < count; i++)
+        free(atomic_exchange(&rings[i], NULL));
+}
+
+int log_ring_parse_level(const char *name, int *p_level)
+{
+    for (size_t i = 0; i < sizeof(level_names) / sizeof(level_names[0]); i++)
+    {
+        if (strcmp(name, level_names[i].name) == 0)
+        {
+            *p_level = level_names[i].level;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void log_conn(int priority, const char *fmt, ...)
+{
+    va_list ap;
+
+    if (priority > log_level)
+        return;
+    if (priority >= LOG_NOTICE && log_sample > 1 &&
+        atomic_fetch_add_explicit(&sample_seq, 1, memory_order_relaxed) % log_sample != 0)
+        return;
+    if (!log_rate_allow())
+    {
+        atomic_fetch_add_explicit(&suppressed, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_ring_t *p_ring = writer_running ? log_ring_local() : NULL;
+    if (!p_ring)
+    {
+        va_start(ap, fmt);
+        vsyslog(priority, fmt, ap);
+        va_end(ap);
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&p_ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&p_ring->tail, memory_order_acquire) == LOG_RING_SLOTS)
+    {
+        atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_entry_t *p_entry = &p_ring->entries[head % LOG_RING_SLOTS];
+    p_entry->priority = priority;
+    va_start(ap, fmt);
+    vsnprintf(p_entry->text, LOG_LINE_MAX, fmt, ap);
+    va_end(ap);
+    atomic_store_explicit(&p_ring->head, head + 1, memory_order_release);
+}
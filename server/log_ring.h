@@ -0,0 +1,23 @@
+#ifndef LOG_RING_H
+#define LOG_RING_H
+
+// Asynchronous logging for per-connection messages. Each thread formats
+// into its own lock-free ring and a background writer passes the lines on
+// to syslog, so the hot path never blocks on /dev/log. Informational
+// messages can be sampled and all of them are capped per second; the
+// writer reports how many were suppressed by the cap or lost to a full ring.
+
+// Syslog priorities above level are discarded here and, through the log
+// mask, in every other syslog() call. Of the informational connection
+// messages only one in sample is kept.
+int log_ring_start(int level, unsigned sample);
+
+// Drain what is left and stop the writer
+void log_ring_stop(void);
+
+// Parse "err", "warning", "notice", "info" or "debug"
+int log_ring_parse_level(const char *name, int *p_level);
+
+void log_conn(int priority, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* LOG_RING_H */
@@ -0,0 +1,328 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include "aesdsocket.h"
+#include "store.h"
+#include "record_index.h"
+
+// Starts live in fixed-size blocks behind a directory that never moves, so
+// lookups are two loads and readers need no lock. A new entry is written
+// before the count that covers it is published with release semantics.
+// Blocks whose records the store no longer retains are retired: their
+// slot is cleared and they are freed once no lookup is in progress, so a
+// store with retention or a bounded ring keeps only the blocks it still
+// covers, whatever has been appended over time.
+#define IDX_BLOCK_SHIFT 16
+#define IDX_BLOCK_LEN ((uint64_t)1 << IDX_BLOCK_SHIFT)
+#define IDX_DIR_LEN 65536
+#define IDX_PERSIST_BATCH 512
+#define IDX_SCAN_CHUNK (64 * 1024)
+#define IDX_RETIRED_MAX 16
+
+static _Atomic(off_t *) idx_dir[IDX_DIR_LEN];
+static _Atomic uint64_t idx_count;
+static off_t idx_end;
+static off_t idx_origin; // start of record 0, whether or not its block is retired
+
+// Retirement, owned by the appending thread
+static _Atomic int idx_readers; // lookups in progress
+static size_t idx_floor;        // first block not retired
+static off_t *retired[IDX_RETIRED_MAX];
+static size_t retired_count;
+
+// Persisted copy: every start except the implicit record 0, in order
+static int idx_fd = -1;
+static off_t pending[IDX_PERSIST_BATCH];
+static size_t pending_count;
+
+// Only with idx_readers raised; fails if record's block was retired
+static int idx_get(uint64_t record, off_t *p_start)
+{
+    off_t *p_block = atomic_load(&idx_dir[record >> IDX_BLOCK_SHIFT]);
+    if (!p_block)
+        return -1;
+    *p_start = p_block[record & (IDX_BLOCK_LEN - 1)];
+    return 0;
+}
+
+// Free retired blocks if no lookup can still be reading one: a lookup
+// that starts after this sees their slots cleared
+static void idx_reclaim(void)
+{
+    if (atomic_load(&idx_readers) != 0)
+        return;
+    for (size_t i = 0; i < retired_count; i++)
+        free(retired[i]);
+    retired_count = 0;
+}
+
+// Retire the blocks below block whose records all start before the store
+// does; store_seek() refuses those records anyway
+static void idx_retire(size_t block)
+{
+    off_t start = store_start();
+
+    while (idx_floor + 1 < block && retired_count < IDX_RETIRED_MAX)
+    {
+        off_t *p_next = atomic_load_explicit(&idx_dir[idx_floor + 1], memory_order_relaxed);
+        if (p_next[0] > start)
+            break;
+        retired[retired_count++] = atomic_exchange(&idx_dir[idx_floor], NULL);
+        idx_floor++;
+    }
+    idx_reclaim();
+}
+
+static int idx_push(off_t start)
+{
+    uint64_t n = atomic_load_explicit(&idx_count, memory_order_relaxed);
+    size_t block = n >> IDX_BLOCK_SHIFT;
+
+    if (block >= IDX_DIR_LEN)
+        return -1;
+
+    off_t *p_block = atomic_load_explicit(&idx_dir[block], memory_order_relaxed);
+    if (!p_block)
+    {
+        idx_retire(block);
+        p_block = malloc(IDX_BLOCK_LEN * sizeof(off_t));
+        if (!p_block)
+            return -1;
+        atomic_store_explicit(&idx_dir[block], p_block, memory_order_release);
+    }
+
+    p_block[n & (IDX_BLOCK_LEN - 1)] = start;
+    atomic_store_explicit(&idx_count, n + 1, memory_order_release);
+    return 0;
+}
+
+// Start over with record 0 at origin
+static int idx_reset(off_t origin)
+{
+    atomic_store(&idx_count, 0);
+    idx_floor = 0;
+    idx_origin = origin;
+    return idx_push(origin);
+}
+
+static void idx_flush_pending(void)
+{
+    size_t len = pending_count * sizeof(off_t);
+    const char *p = (const char *)pending;
+
+    while (len > 0)
+    {
+        ssize_t n = write(idx_fd, p, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Failed to write record index, persistence disabled");
+            close(idx_fd);
+            idx_fd = -1;
+            break;
+        }
+        p += n;
+        len -= n;
+    }
+    pending_count = 0;
+}
+
+// Load persisted starts that still describe the store; returns how many
+static uint64_t idx_load(off_t store_start, off_t store_len)
+{
+    off_t last = store_start;
+    uint64_t loaded = 0;
+    ssize_t n;
+
+    while ((n = read(idx_fd, pending, sizeof(pending))) > 0)
+    {
+        for (size_t i = 0; i < (size_t)n / sizeof(off_t); i++)
+        {
+            // Anything out of order or beyond the data is a stale tail
+            if (pending[i] <= last || pending[i] > store_len || idx_push(pending[i]) != 0)
+                goto done;
+            last = pending[i];
+            loaded++;
+        }
+    }
+done:
+    idx_end = last;
+    ftruncate(idx_fd, loaded * sizeof(off_t));
+    lseek(idx_fd, 0, SEEK_END);
+    return loaded;
+}
+
+// Load the starts p_mark vouches for without checking each one. Records
+// retention has dropped since keep their numbers and fail lookups in
+// store_seek(). Returns how many were loaded, or -1 if the file holds
+// fewer than the mark says.
+static int64_t idx_load_mark(const record_index_mark_t *p_mark)
+{
+    uint64_t left = p_mark->records;
+    int64_t loaded = 0;
+
+    if (idx_reset(p_mark->origin) != 0)
+        return -1;
+
+    while (left > 0)
+    {
+        size_t want = left < IDX_PERSIST_BATCH ? left : IDX_PERSIST_BATCH;
+        ssize_t n = read(idx_fd, pending, want * sizeof(off_t));
+        if (n <= 0 || n % sizeof(off_t) != 0)
+            return -1;
+        for (size_t i = 0; i < (size_t)n / sizeof(off_t); i++)
+        {
+            if (idx_push(pending[i]) != 0)
+                return -1;
+            loaded++;
+        }
+        left -= n / sizeof(off_t);
+    }
+
+    // Starts persisted after the mark are found again by the scan
+    idx_end = p_mark->end;
+    ftruncate(idx_fd, p_mark->records * sizeof(off_t));
+    lseek(idx_fd, 0, SEEK_END);
+    return loaded;
+}
+
+int record_index_open(int persist, const record_index_mark_t *p_mark)
+{
+    off_t store_len = store_size();
+    int64_t loaded = 0;
+
+    // Record 0 is the oldest one the store still retains
+    idx_end = store_start();
+    pending_count = 0;
+    if (idx_reset(idx_end) != 0)
+        return -1;
+
+    if (persist)
+    {
+        idx_fd = open(INDEX_FILE_PATH, O_CREAT | O_RDWR, 0644);
+        if (idx_fd == -1)
+        {
+            syslog(LOG_ERR, "Failed to open record index file");
+            return -1;
+        }
+        loaded = p_mark ? idx_load_mark(p_mark) : -1;
+        if (loaded < 0)
+        {
+            // Without a mark, or with one the file falls short of, every
+            // persisted start is checked
+            idx_end = store_start();
+            idx_reset(idx_end);
+            lseek(idx_fd, 0, SEEK_SET);
+            loaded = idx_load(idx_end, store_len);
+        }
+    }
+
+    // Whatever the persisted index does not cover is scanned from the store
+    char *chunk = malloc(IDX_SCAN_CHUNK);
+    if (!chunk)
+        return -1;
+    while (idx_end < store_len)
+    {
+        ssize_t n = store_read(idx_end, chunk, IDX_SCAN_CHUNK);
+        if (n <= 0 || record_index_note(chunk, n) != 0)
+            break;
+    }
+    free(chunk);
+
+    syslog(LOG_INFO, "Record index ready: %llu records, %lld loaded",
+           (unsigned long long)atomic_load(&idx_count), (long long)loaded);
+    return idx_end == store_len ? 0 : -1;
+}
+
+void record_index_close(void)
+{
+    if (idx_fd >= 0)
+    {
+        idx_flush_pending();
+        if (idx_fd >= 0)
+            close(idx_fd);
+        idx_fd = -1;
+    }
+
+    for (size_t i = 0; i < IDX_DIR_LEN; i++)
+    {
+        free(atomic_load(&idx_dir[i]));
+        atomic_store(&idx_dir[i], NULL);
+    }
+    for (size_t i = 0; i < retired_count; i++)
+        free(retired[i]);
+    retired_count = 0;
+    idx_floor = 0;
+    atomic_store(&idx_count, 0);
+}
+
+int record_index_mark(record_index_mark_t *p_mark)
+{
+    if (idx_fd < 0)
+        return -1;
+    idx_flush_pending();
+    if (idx_fd < 0 || fdatasync(idx_fd) != 0)
+        return -1;
+
+    // Starts are only ever appended, so the file ends where we write
+    off_t len = lseek(idx_fd, 0, SEEK_CUR);
+    if (len < 0)
+        return -1;
+    p_mark->records = len / sizeof(off_t);
+    p_mark->origin = idx_origin;
+    p_mark->end = idx_end;
+    return 0;
+}
+
+int record_index_note(const char *buf, size_t len)
+{
+    const char *p = buf;
+    const char *end = buf + len;
+    const char *nl;
+
+    while ((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        off_t start = idx_end + (nl - buf) + 1;
+        if (idx_push(start) != 0)
+        {
+            syslog(LOG_ERR, "Record index full");
+            return -1;
+        }
+        if (idx_fd >= 0)
+        {
+            pending[pending_count++] = start;
+            if (pending_count == IDX_PERSIST_BATCH)
+                idx_flush_pending();
+        }
+        p = nl + 1;
+    }
+    idx_end += len;
+    // Blocks left behind by a lookup in progress go as soon as it is done
+    if (retired_count)
+        idx_reclaim();
+    return 0;
+}
+
+int record_index_lookup(uint64_t record, off_t *p_start, off_t *p_next)
+{
+    uint64_t count = atomic_load_explicit(&idx_count, memory_order_acquire);
+    int ret = -1;
+
+    if (record >= count)
+        return -1;
+    atomic_fetch_add(&idx_readers, 1);
+    if (idx_get(record, p_start) == 0)
+    {
+        *p_next = -1;
+        ret = record + 1 < count ? idx_get(record + 1, p_next) : 0;
+    }
+    atomic_fetch_sub(&idx_readers, 1);
+    return ret;
+}
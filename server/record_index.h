@@ -0,0 +1,42 @@
+#ifndef RECORD_INDEX_H
+#define RECORD_INDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+// Start offsets of the newline-delimited records in the store, maintained
+// on every append. Record 0 starts at store_start() when the index is built
+// and record N starts right after the Nth newline from there, so a start can
+// exist before its first byte does.
+
+// How far the persisted copy was known to be in step with the store: its
+// first records starts cover the store from record 0 at origin up to end
+typedef struct
+{
+    uint64_t records;
+    off_t origin;
+    off_t end;
+} record_index_mark_t;
+
+// Build the index for the current store content, loading the persisted
+// copy at INDEX_FILE_PATH first when persist is set and scanning only what
+// it does not cover. With p_mark, the starts it vouches for are taken as
+// they are, numbered as they were, and only the store beyond its end is
+// scanned.
+int record_index_open(int persist, const record_index_mark_t *p_mark);
+void record_index_close(void);
+
+// Flush the persisted copy to stable storage and report how far it reaches.
+// Serialized with record_index_note().
+int record_index_mark(record_index_mark_t *p_mark);
+
+// Account for bytes just appended at the end of the store. Calls must be
+// serialized and made in append order.
+int record_index_note(const char *buf, size_t len);
+
+// Constant-time lookup of record's start. *p_next is the start of the
+// following record, or -1 if record is the last one. Fails for records
+// whose block was retired after the store dropped them.
+int record_index_lookup(uint64_t record, off_t *p_start, off_t *p_next);
+
+#endif /* RECORD_INDEX_H */
@@ -0,0 +1,142 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <syslog.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "shard.h"
+
+typedef struct
+{
+    pthread_t tid;
+    int listen_fd;
+    int cpu; // -1: not pinned
+} shard_t;
+
+// Interrupts a shard blocked in accept() or epoll_wait(); the handler only
+// has to exist, so the call fails with EINTR
+#define SHARD_WAKE_SIGNAL SIGUSR1
+#define SHARD_WAKE_RETRY_MS 100
+
+static shard_t *shards;
+static int shard_count;
+static shard_serve_fn_t shard_serve;
+
+static void shard_wake(int signo)
+{
+    (void)signo;
+}
+
+static void *shard_thread(void *arg)
+{
+    shard_t *p_shard = (shard_t *)arg;
+    sigset_t wake;
+
+    sigemptyset(&wake);
+    sigaddset(&wake, SHARD_WAKE_SIGNAL);
+    pthread_sigmask(SIG_UNBLOCK, &wake, NULL);
+
+    if (p_shard->cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(p_shard->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            syslog(LOG_WARNING, "Failed to pin shard to CPU %d", p_shard->cpu);
+    }
+
+    if (shard_serve(p_shard->listen_fd) != 0)
+        syslog(LOG_ERR, "Shard on CPU %d failed", p_shard->cpu);
+    return NULL;
+}
+
+// The nth CPU this process may run on, wrapping around
+static int shard_pick_cpu(const cpu_set_t *p_allowed, int n)
+{
+    int count = CPU_COUNT(p_allowed);
+    if (count <= 0)
+        return -1;
+
+    n %= count;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, p_allowed) && n-- == 0)
+            return cpu;
+    }
+    return -1;
+}
+
+int shard_start(const int *p_fds, int n_shards, shard_serve_fn_t serve)
+{
+    cpu_set_t allowed;
+    int pin = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+    shards = calloc(n_shards, sizeof(shard_t));
+    if (!shards)
+    {
+        syslog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+    shard_serve = serve;
+
+    struct sigaction sa = {0};
+    sa.sa_handler = shard_wake;
+    sigaction(SHARD_WAKE_SIGNAL, &sa, NULL);
+
+    for (int i = 0; i < n_shards; i++)
+    {
+        shards[i].listen_fd = p_fds[i];
+        shards[i].cpu = pin ? shard_pick_cpu(&allowed, i) : -1;
+        if (pthread_create(&shards[i].tid, NULL, shard_thread, &shards[i]) != 0)
+        {
+            syslog(LOG_ERR, "pthread_create() failed for shard thread");
+            shard_count = i;
+            shard_stop(0);
+            return -1;
+        }
+    }
+    shard_count = n_shards;
+
+    syslog(LOG_INFO, "Started %d acceptor shards", n_shards);
+    return 0;
+}
+
+void shard_stop(int keep_sockets)
+{
+    // A shut down listening socket fails a blocked accept() and reports
+    // readiness to epoll, so every shard gets to check stop_requested
+    for (int i = 0; !keep_sockets && i < shard_count; i++)
+        shutdown(shards[i].listen_fd, SHUT_RDWR);
+
+    for (int i = 0; i < shard_count; i++)
+    {
+        if (!keep_sockets)
+        {
+            pthread_join(shards[i].tid, NULL);
+            continue;
+        }
+        // A signal landing just before the shard blocks is lost, so repeat it
+        for (;;)
+        {
+            pthread_kill(shards[i].tid, SHARD_WAKE_SIGNAL);
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += SHARD_WAKE_RETRY_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            if (pthread_timedjoin_np(shards[i].tid, NULL, &deadline) != ETIMEDOUT)
+                break;
+        }
+    }
+
+    free(shards);
+    shards = NULL;
+    shard_count = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+// Acceptor shards: one thread per listening socket, each pinned to its own
+// CPU. With SO_REUSEPORT sockets on the same port the kernel spreads new
+// connections over the shards, so they share no accept queue or lock.
+
+// Serves one listening socket until stop_requested is set
+typedef int (*shard_serve_fn_t)(int listen_fd);
+
+// Start one thread per socket in p_fds running serve. Call with the stop
+// signals blocked so the threads inherit that and leave them to the caller.
+int shard_start(const int *p_fds, int n_shards, shard_serve_fn_t serve);
+
+// Wake every shard by shutting its socket down and join them. Sockets that
+// are being handed over stay open: the shards are interrupted with a
+// signal instead.
+void shard_stop(int keep_sockets);
+
+#endif /* SHARD_H */
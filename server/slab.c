@@ -0,0 +1,198 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <pthread.h>
+#include "slab.h"
+#include "stats.h"
+
+#define SLAB_OBJECTS 64
+#define SLAB_ALIGN 64 // objects never share a cache line
+#define MAG_SIZE 32   // a magazine trades half of this with the depot
+
+typedef struct slab_obj
+{
+    struct slab_obj *p_next;
+} slab_obj_t;
+
+// Header of every slab, padded so the objects after it stay aligned
+typedef struct slab_chunk
+{
+    struct slab_chunk *p_next;
+} slab_chunk_t;
+
+typedef struct magazine
+{
+    struct magazine *p_next; // every magazine of the cache
+    slab_cache_t *p_cache;
+    int count;
+    void *objs[MAG_SIZE];
+} magazine_t;
+
+struct slab_cache
+{
+    size_t obj_size;
+    pthread_key_t key;
+    pthread_mutex_t lock; // guards everything below
+    slab_obj_t *p_depot;
+    slab_chunk_t *p_chunks;
+    magazine_t *p_magazines;
+};
+
+static void slab_depot_put(slab_cache_t *p_cache, void *p_obj)
+{
+    slab_obj_t *p_free = p_obj;
+    p_free->p_next = p_cache->p_depot;
+    p_cache->p_depot = p_free;
+}
+
+// A thread is gone: its free objects go back to the depot
+static void slab_magazine_release(void *arg)
+{
+    magazine_t *p_mag = arg;
+    slab_cache_t *p_cache = p_mag->p_cache;
+
+    pthread_mutex_lock(&p_cache->lock);
+    while (p_mag->count > 0)
+        slab_depot_put(p_cache, p_mag->objs[--p_mag->count]);
+    for (magazine_t **pp = &p_cache->p_magazines; *pp; pp = &(*pp)->p_next)
+    {
+        if (*pp == p_mag)
+        {
+            *pp = p_mag->p_next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&p_cache->lock);
+    free(p_mag);
+}
+
+static magazine_t *slab_magazine(slab_cache_t *p_cache)
+{
+    magazine_t *p_mag = pthread_getspecific(p_cache->key);
+    if (p_mag)
+        return p_mag;
+
+    p_mag = calloc(1, sizeof(magazine_t));
+    if (!p_mag)
+        return NULL;
+    p_mag->p_cache = p_cache;
+    pthread_setspecific(p_cache->key, p_mag);
+
+    pthread_mutex_lock(&p_cache->lock);
+    p_mag->p_next = p_cache->p_magazines;
+    p_cache->p_magazines = p_mag;
+    pthread_mutex_unlock(&p_cache->lock);
+    return p_mag;
+}
+
+// Fill an empty magazine halfway from the depot, carving a new slab when
+// the depot is empty too
+static int slab_refill(slab_cache_t *p_cache, magazine_t *p_mag)
+{
+    int carved = 0;
+
+    pthread_mutex_lock(&p_cache->lock);
+    if (!p_cache->p_depot)
+    {
+        slab_chunk_t *p_chunk = aligned_alloc(SLAB_ALIGN, SLAB_ALIGN + p_cache->obj_size * SLAB_OBJECTS);
+        if (!p_chunk)
+        {
+            pthread_mutex_unlock(&p_cache->lock);
+            return -1;
+        }
+        p_chunk->p_next = p_cache->p_chunks;
+        p_cache->p_chunks = p_chunk;
+
+        char *p_objs = (char *)p_chunk + SLAB_ALIGN;
+        for (int i = SLAB_OBJECTS - 1; i >= 0; i--)
+            slab_depot_put(p_cache, p_objs + i * p_cache->obj_size);
+        carved = 1;
+    }
+
+    while (p_mag->count < MAG_SIZE / 2 && p_cache->p_depot)
+    {
+        slab_obj_t *p_obj = p_cache->p_depot;
+        p_cache->p_depot = p_obj->p_next;
+        p_mag->objs[p_mag->count++] = p_obj;
+    }
+    pthread_mutex_unlock(&p_cache->lock);
+
+    stats_add(carved ? STAT_SLAB_MISSES : STAT_SLAB_HITS, 1);
+    return 0;
+}
+
+slab_cache_t *slab_create(size_t obj_size)
+{
+    slab_cache_t *p_cache = calloc(1, sizeof(slab_cache_t));
+    if (!p_cache)
+        return NULL;
+
+    if (obj_size < sizeof(slab_obj_t))
+        obj_size = sizeof(slab_obj_t);
+    p_cache->obj_size = (obj_size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+
+    if (pthread_key_create(&p_cache->key, slab_magazine_release) != 0)
+    {
+        free(p_cache);
+        return NULL;
+    }
+    pthread_mutex_init(&p_cache->lock, NULL);
+    return p_cache;
+}
+
+void slab_destroy(slab_cache_t *p_cache)
+{
+    if (!p_cache)
+        return;
+
+    // Deleting the key first keeps thread exits away from the magazines
+    pthread_key_delete(p_cache->key);
+    while (p_cache->p_magazines)
+    {
+        magazine_t *p_mag = p_cache->p_magazines;
+        p_cache->p_magazines = p_mag->p_next;
+        free(p_mag);
+    }
+    while (p_cache->p_chunks)
+    {
+        slab_chunk_t *p_chunk = p_cache->p_chunks;
+        p_cache->p_chunks = p_chunk->p_next;
+        free(p_chunk);
+    }
+    pthread_mutex_destroy(&p_cache->lock);
+    free(p_cache);
+}
+
+void *slab_alloc(slab_cache_t *p_cache)
+{
+    magazine_t *p_mag = slab_magazine(p_cache);
+    if (!p_mag)
+        return NULL;
+
+    if (p_mag->count > 0)
+        stats_add(STAT_SLAB_HITS, 1);
+    else if (slab_refill(p_cache, p_mag) != 0)
+        return NULL;
+    return p_mag->objs[--p_mag->count];
+}
+
+void slab_free(slab_cache_t *p_cache, void *p_obj)
+{
+    magazine_t *p_mag = slab_magazine(p_cache);
+
+    if (!p_mag || p_mag->count == MAG_SIZE)
+    {
+        pthread_mutex_lock(&p_cache->lock);
+        if (!p_mag)
+            slab_depot_put(p_cache, p_obj);
+        else
+        {
+            while (p_mag->count > MAG_SIZE / 2)
+                slab_depot_put(p_cache, p_mag->objs[--p_mag->count]);
+        }
+        pthread_mutex_unlock(&p_cache->lock);
+        if (!p_mag)
+            return;
+    }
+    p_mag->objs[p_mag->count++] = p_obj;
+}
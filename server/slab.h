@@ -0,0 +1,22 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+
+// Cache of fixed-size objects carved from slabs that are kept until the
+// cache is destroyed, so a connection storm reuses memory instead of
+// churning the allocator. Each thread holds a small magazine of free
+// objects and trades with a shared depot in batches, so the depot lock is
+// taken once per batch rather than per object.
+typedef struct slab_cache slab_cache_t;
+
+slab_cache_t *slab_create(size_t obj_size);
+
+// Every object must have been freed, and threads that used the cache must
+// not touch it again
+void slab_destroy(slab_cache_t *p_cache);
+
+void *slab_alloc(slab_cache_t *p_cache);
+void slab_free(slab_cache_t *p_cache, void *p_obj);
+
+#endif /* SLAB_H */
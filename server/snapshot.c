@@ -0,0 +1,252 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include "store.h"
+#include "stats.h"
+#include "snapshot.h"
+
+// Snapshots larger than this are not kept; replies read the store instead
+#define SNAPSHOT_MAX ((off_t)64 * 1024 * 1024)
+
+// An idle snapshot up to this size stays published for the next reply
+#define SNAPSHOT_RETAIN_DEFAULT ((off_t)1024 * 1024)
+
+// A tail extent smaller than this is merged with the next delta, so a
+// store growing by small packets does not splinter into tiny extents
+#define SNAP_EXTENT_MIN (64 * 1024)
+
+// Extents are mapped on their own rather than malloc'd, so freeing a large
+// snapshot hands its memory back instead of leaving it in the heap
+struct snap_extent
+{
+    _Atomic int refs;
+    off_t off;
+    size_t len;
+    char data[];
+};
+
+// The published snapshot holds a reference of its own until it is
+// replaced, or until no reply uses it any more. Readers take theirs
+// without a lock; whoever drops the published reference first waits out
+// getters that may have loaded the pointer but not yet counted themselves.
+static _Atomic(snapshot_t *) p_current;
+static _Atomic int snap_getters;
+
+// Set while one reply builds the next snapshot; the others read the store
+// meanwhile instead of waiting behind the copy or making their own
+static atomic_flag snap_building = ATOMIC_FLAG_INIT;
+static off_t snap_retain = SNAPSHOT_RETAIN_DEFAULT;
+
+static void extent_put(snap_extent_t *p_ext)
+{
+    if (atomic_fetch_sub(&p_ext->refs, 1) == 1)
+        munmap(p_ext, sizeof(snap_extent_t) + p_ext->len);
+}
+
+// A new extent for [off, end), starting with the bytes of p_prefix if any
+static snap_extent_t *extent_read(const snap_extent_t *p_prefix, off_t off, off_t end)
+{
+    size_t map_len = sizeof(snap_extent_t) + (end - off);
+    snap_extent_t *p_ext = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    size_t got = 0;
+
+    if (p_ext == MAP_FAILED)
+        return NULL;
+    if (p_prefix)
+    {
+        memcpy(p_ext->data, p_prefix->data, p_prefix->len);
+        got = p_prefix->len;
+    }
+    // Stores may return less than asked, e.g. at a segment boundary
+    while ((off_t)got < end - off)
+    {
+        ssize_t n = store_read(off + got, p_ext->data + got, end - off - got);
+        if (n <= 0)
+        {
+            munmap(p_ext, map_len);
+            return NULL;
+        }
+        got += n;
+    }
+    atomic_init(&p_ext->refs, 1);
+    p_ext->off = off;
+    p_ext->len = got;
+    return p_ext;
+}
+
+// Build the snapshot of [start, end) from the extents of p_old that are
+// still retained plus the bytes appended since
+static snapshot_t *snapshot_build(const snapshot_t *p_old, off_t start, off_t end)
+{
+    size_t keep = 0;
+    size_t skip = 0;
+
+    if (p_old && p_old->end <= end && p_old->end > start)
+    {
+        while (skip < p_old->n_extents &&
+               p_old->extents[skip]->off + (off_t)p_old->extents[skip]->len <= start)
+            skip++;
+        keep = p_old->n_extents - skip;
+    }
+
+    snapshot_t *p_snap = malloc(sizeof(snapshot_t) + (keep + 1) * sizeof(snap_extent_t *));
+    if (!p_snap)
+        return NULL;
+    atomic_init(&p_snap->refs, 1);
+    p_snap->start = start;
+    p_snap->end = end;
+    p_snap->n_extents = 0;
+
+    for (size_t i = 0; i < keep; i++)
+    {
+        snap_extent_t *p_ext = p_old->extents[skip + i];
+        atomic_fetch_add(&p_ext->refs, 1);
+        p_snap->extents[p_snap->n_extents++] = p_ext;
+    }
+
+    off_t from = keep ? p_old->end : start;
+    if (from < end)
+    {
+        snap_extent_t *p_tail = keep ? p_snap->extents[keep - 1] : NULL;
+        snap_extent_t *p_ext;
+
+        if (p_tail && p_tail->len < SNAP_EXTENT_MIN)
+        {
+            p_ext = extent_read(p_tail, p_tail->off, end);
+            if (p_ext)
+            {
+                extent_put(p_tail);
+                p_snap->n_extents--;
+            }
+        }
+        else
+            p_ext = extent_read(NULL, from, end);
+
+        if (!p_ext)
+        {
+            snapshot_put(p_snap);
+            return NULL;
+        }
+        p_snap->extents[p_snap->n_extents++] = p_ext;
+    }
+    return p_snap;
+}
+
+// A reference to the published snapshot, or NULL if there is none
+static snapshot_t *snapshot_acquire(void)
+{
+    atomic_fetch_add(&snap_getters, 1);
+    snapshot_t *p_snap = atomic_load(&p_current);
+    if (p_snap)
+        atomic_fetch_add(&p_snap->refs, 1);
+    atomic_fetch_sub(&snap_getters, 1);
+    return p_snap;
+}
+
+// Drop the reference p_current held on p_snap, which it no longer points to
+static void snapshot_unpublish(snapshot_t *p_snap)
+{
+    while (atomic_load(&snap_getters) != 0)
+        sched_yield();
+    snapshot_put(p_snap);
+}
+
+snapshot_t *snapshot_get(void)
+{
+    off_t start = store_start();
+    off_t end = store_size();
+    snapshot_t *p_old = snapshot_acquire();
+
+    if (p_old && p_old->start == start && p_old->end == end)
+    {
+        stats_add(STAT_SNAP_HITS, 1);
+        return p_old;
+    }
+    if (end - start > SNAPSHOT_MAX || end == start || store_in_memory() ||
+        atomic_flag_test_and_set(&snap_building))
+    {
+        snapshot_put(p_old);
+        return NULL;
+    }
+
+    snapshot_t *p_snap = snapshot_build(p_old, start, end);
+    if (p_snap)
+    {
+        // Replies still sending from the old one keep it alive
+        snapshot_t *p_expected = p_old;
+        atomic_fetch_add(&p_snap->refs, 1);
+        if (atomic_compare_exchange_strong(&p_current, &p_expected, p_snap))
+        {
+            if (p_old)
+                snapshot_unpublish(p_old);
+        }
+        else
+            atomic_fetch_sub(&p_snap->refs, 1); // cleared meanwhile; this reply keeps it to itself
+        stats_add(STAT_SNAP_BUILDS, 1);
+    }
+    atomic_flag_clear(&snap_building);
+    snapshot_put(p_old);
+    return p_snap;
+}
+
+void snapshot_put(snapshot_t *p_snap)
+{
+    if (!p_snap)
+        return;
+    int refs = atomic_fetch_sub(&p_snap->refs, 1);
+    if (refs == 2)
+    {
+        // Only the published reference is left: no reply sends from it, so
+        // unless it is small, let it go rather than keep a copy of the store
+        snapshot_t *p_expected = p_snap;
+        if (p_snap->end - p_snap->start <= snap_retain)
+            return;
+        if (atomic_compare_exchange_strong(&p_current, &p_expected, NULL))
+            snapshot_unpublish(p_snap);
+        return;
+    }
+    if (refs != 1)
+        return;
+    for (size_t i = 0; i < p_snap->n_extents; i++)
+        extent_put(p_snap->extents[i]);
+    free(p_snap);
+}
+
+const char *snapshot_data(const snapshot_t *p_snap, off_t off, size_t *p_len)
+{
+    size_t lo = 0;
+    size_t hi = p_snap->n_extents;
+
+    if (off < p_snap->start || off >= p_snap->end)
+        return NULL;
+    // Last extent starting at or before off
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (p_snap->extents[mid]->off <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+
+    const snap_extent_t *p_ext = p_snap->extents[lo];
+    size_t avail = p_ext->off + p_ext->len - off;
+    if (*p_len > avail)
+        *p_len = avail;
+    return p_ext->data + (off - p_ext->off);
+}
+
+void snapshot_set_retain(off_t bytes)
+{
+    snap_retain = bytes;
+}
+
+void snapshot_clear(void)
+{
+    snapshot_t *p_snap = atomic_exchange(&p_current, NULL);
+    if (p_snap)
+        snapshot_unpublish(p_snap);
+}
@@ -0,0 +1,45 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+// Shared, immutable image of the retained store for copying replies. The
+// committed range [start, end) identifies the content, since the store only
+// grows at the end and shrinks at the start, so every reply that begins
+// while it is unchanged reuses one snapshot instead of reading the store
+// again. A newer snapshot keeps the extents of the one before and reads
+// only what was appended since. Readers hold a reference for as long as
+// they send from it; the last one to let go frees it, so no copy of the
+// store larger than the retain size outlives the replies sending from it.
+typedef struct snap_extent snap_extent_t;
+
+typedef struct
+{
+    _Atomic int refs;
+    off_t start;
+    off_t end;
+    size_t n_extents;
+    snap_extent_t *extents[];
+} snapshot_t;
+
+// A reference to a snapshot of everything retained right now, or NULL if
+// the store is too large to hold in memory, already lives there or cannot
+// be read, or if another reply is building the snapshot right now
+snapshot_t *snapshot_get(void);
+void snapshot_put(snapshot_t *p_snap);
+
+// Bytes of the snapshot at off; *p_len is the most the caller wants on
+// entry and how many are contiguous there on return. NULL if off is
+// outside the snapshot.
+const char *snapshot_data(const snapshot_t *p_snap, off_t off, size_t *p_len);
+
+// Largest snapshot kept published while no reply uses it, 0 for none.
+// Set before serving.
+void snapshot_set_retain(off_t bytes);
+
+// Drop the current snapshot; the store behind it is going away
+void snapshot_clear(void);
+
+#endif /* SNAPSHOT_H */
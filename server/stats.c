@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "stats.h"
+#include "hist.h"
+
+#define STATS_SHARDS 64
+
+typedef struct
+{
+    _Atomic uint64_t counters[STAT_COUNTERS];
+    _Atomic uint64_t max_ns[STAT_PHASES];
+    _Atomic uint64_t hist[STAT_PHASES][HIST_BUCKETS];
+} __attribute__((aligned(64))) stats_shard_t;
+
+static stats_shard_t shards[STATS_SHARDS];
+
+static const char *const counter_names[] = {
+    [STAT_CONNECTIONS] = "connections",
+    [STAT_BYTES_IN] = "bytes_in",
+    [STAT_BYTES_OUT] = "bytes_out",
+    [STAT_PACKETS] = "packets",
+    [STAT_ERRORS] = "errors",
+    [STAT_EVICTIONS] = "evictions",
+    [STAT_SLAB_HITS] = "slab_hits",
+    [STAT_SLAB_MISSES] = "slab_misses",
+    [STAT_BUF_HITS] = "buf_hits",
+    [STAT_BUF_MISSES] = "buf_misses",
+    [STAT_SNAP_HITS] = "snap_hits",
+    [STAT_SNAP_BUILDS] = "snap_builds",
+};
+
+static const char *const phase_names[] = {
+    [STAT_PHASE_ACCEPT] = "accept",
+    [STAT_PHASE_RECV_COMMIT] = "recv_commit",
+    [STAT_PHASE_COMMIT] = "commit",
+    [STAT_PHASE_REPLAY] = "replay",
+};
+
+static stats_shard_t *stats_shard(void)
+{
+    int cpu = sched_getcpu();
+    return &shards[cpu > 0 ? cpu % STATS_SHARDS : 0];
+}
+
+uint64_t stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_add(stat_counter_t counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(&stats_shard()->counters[counter], n, memory_order_relaxed);
+}
+
+void stats_record(stat_phase_t phase, uint64_t ns)
+{
+    stats_shard_t *p_shard = stats_shard();
+    uint64_t max = atomic_load_explicit(&p_shard->max_ns[phase], memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&p_shard->hist[phase][hist_bucket(ns)], 1, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&p_shard->max_ns[phase], &max, ns,
+                                                              memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+// Append to buf, stopping quietly once it is full
+static void stats_print(char *buf, size_t len, size_t *p_used, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(buf + *p_used, len - *p_used, fmt, ap);
+    va_end(ap);
+
+    if (n > 0)
+        *p_used += (size_t)n < len - *p_used ? (size_t)n : len - *p_used - 1;
+}
+
+size_t stats_format(char *buf, size_t len)
+{
+    size_t used = 0;
+
+    if (len == 0)
+        return 0;
+    buf[0] = '\0';
+
+    stats_print(buf, len, &used, "AESDSTATS:");
+    for (int c = 0; c < STAT_COUNTERS; c++)
+    {
+        uint64_t sum = 0;
+        for (int s = 0; s < STATS_SHARDS; s++)
+            sum += atomic_load_explicit(&shards[s].counters[c], memory_order_relaxed);
+        stats_print(buf, len, &used, "%s%s=%llu", c ? " " : "", counter_names[c], (unsigned long long)sum);
+    }
+    stats_print(buf, len, &used, "\n");
+
+    for (int p = 0; p < STAT_PHASES; p++)
+    {
+        uint64_t hist[HIST_BUCKETS] = {0};
+        uint64_t total = 0;
+        uint64_t max = 0;
+
+        for (int s = 0; s < STATS_SHARDS; s++)
+        {
+            uint64_t shard_max = atomic_load_explicit(&shards[s].max_ns[p], memory_order_relaxed);
+            if (shard_max > max)
+                max = shard_max;
+            for (size_t i = 0; i < HIST_BUCKETS; i++)
+            {
+                uint64_t count = atomic_load_explicit(&shards[s].hist[p][i], memory_order_relaxed);
+                hist[i] += count;
+                total += count;
+            }
+        }
+
+        // Bucket tops overshoot; no percentile can exceed the real maximum
+        uint64_t p50 = hist_percentile(hist, total, 500);
+        uint64_t p99 = hist_percentile(hist, total, 990);
+        uint64_t p999 = hist_percentile(hist, total, 999);
+        stats_print(buf, len, &used, "AESDSTATS:%s count=%llu p50_us=%llu p99_us=%llu p999_us=%llu max_us=%llu\n",
+                    phase_names[p], (unsigned long long)total,
+                    (unsigned long long)(p50 < max ? p50 : max) / 1000,
+                    (unsigned long long)(p99 < max ? p99 : max) / 1000,
+                    (unsigned long long)(p999 < max ? p999 : max) / 1000,
+                    (unsigned long long)max / 1000);
+    }
+    return used;
+}
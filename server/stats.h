@@ -0,0 +1,48 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Always-on counters and latency histograms. Updates go to a cache-line
+// aligned shard picked by the current CPU with relaxed atomics, so hot
+// paths never share a line; reads sum the shards without stopping anyone.
+
+typedef enum
+{
+    STAT_CONNECTIONS,
+    STAT_BYTES_IN,
+    STAT_BYTES_OUT,
+    STAT_PACKETS, // appends made on behalf of clients
+    STAT_ERRORS,  // store rejections and failed socket calls
+    STAT_EVICTIONS,
+    STAT_SLAB_HITS, // slab_alloc() served without carving a new slab
+    STAT_SLAB_MISSES,
+    STAT_BUF_HITS, // buf_pool_get() served without malloc
+    STAT_BUF_MISSES,
+    STAT_SNAP_HITS, // replies that reused the current store snapshot
+    STAT_SNAP_BUILDS,
+    STAT_COUNTERS
+} stat_counter_t;
+
+// Latency histograms in nanoseconds, bucketed as in hist.h
+typedef enum
+{
+    STAT_PHASE_ACCEPT,      // accept() until the connection is first served
+    STAT_PHASE_RECV_COMMIT, // first byte of a packet until it is committed
+    STAT_PHASE_COMMIT,      // one store_append() call
+    STAT_PHASE_REPLAY,      // reply set up until its last byte is sent
+    STAT_PHASES
+} stat_phase_t;
+
+// Monotonic clock in nanoseconds
+uint64_t stats_now(void);
+
+void stats_add(stat_counter_t counter, uint64_t n);
+void stats_record(stat_phase_t phase, uint64_t ns);
+
+// Write a snapshot as "AESDSTATS:" lines into buf, truncated to len.
+// Returns the length written.
+size_t stats_format(char *buf, size_t len);
+
+#endif /* STATS_H */
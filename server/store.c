@@ -0,0 +1,430 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "aesdsocket.h"
+#include "store.h"
+#include "record_index.h"
+#include "stats.h"
+#include "commit.h"
+#include "zblock.h"
+#include "snapshot.h"
+
+static const store_ops_t *store_ops = &store_file_ops;
+static reply_mode_t store_reply_mode = REPLY_COPY;
+static uint64_t generation;
+static int store_kept; // checkpointed, so its files outlive the process
+
+// The interval syncer and checkpoints both sync; backends track how far
+// they have synced without a lock of their own
+static pthread_mutex_t sync_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// The checkpoint vouches for the last bytes it covers by their hash, so a
+// data file that was replaced or cut short since is not trusted
+#define CKPT_TAIL 4096
+#define CKPT_TEXT_MAX 512
+static record_index_mark_t ckpt_mark; // what the latest checkpoint covers
+
+static const store_ops_t *const store_backends[] = {
+    [STORE_FILE] = &store_file_ops,
+    [STORE_MEMORY] = &store_mem_ops,
+    [STORE_MMAP] = &store_mmap_ops,
+    [STORE_SEGMENTED] = &store_seg_ops,
+    [STORE_RING] = &store_ring_ops,
+};
+
+int store_parse_kind(const char *name, store_kind_t *p_kind)
+{
+    for (size_t i = 0; i < sizeof(store_backends) / sizeof(store_backends[0]); i++)
+    {
+        if (strcmp(name, store_backends[i]->name) == 0)
+        {
+            *p_kind = (store_kind_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static const char *const reply_mode_names[] = {
+    [REPLY_COPY] = "copy",
+    [REPLY_SENDFILE] = "sendfile",
+    [REPLY_SPLICE] = "splice",
+};
+
+int store_parse_reply_mode(const char *name, reply_mode_t *p_mode)
+{
+    for (size_t i = 0; i < sizeof(reply_mode_names) / sizeof(reply_mode_names[0]); i++)
+    {
+        if (strcmp(name, reply_mode_names[i]) == 0)
+        {
+            *p_mode = (reply_mode_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+int store_parse_durability(const char *name, store_config_t *p_config)
+{
+    char *end;
+
+    if (strcmp(name, "none") == 0)
+        p_config->durability = DURABLE_NONE;
+    else if (strcmp(name, "batch") == 0)
+        p_config->durability = DURABLE_BATCH;
+    else
+    {
+        unsigned long ms = strtoul(name, &end, 10);
+        if (end == name || *end != '\0' || ms == 0 || ms > 60000)
+            return -1;
+        p_config->durability = DURABLE_INTERVAL;
+        p_config->sync_interval_ms = ms;
+    }
+    return 0;
+}
+
+int store_parse_size(const char *arg, off_t *p_size)
+{
+    char *end;
+    unsigned long long size = strtoull(arg, &end, 10);
+
+    if (end == arg)
+        return -1;
+    switch (*end)
+    {
+    case 'G':
+        size *= 1024;
+        // fall through
+    case 'M':
+        size *= 1024;
+        // fall through
+    case 'K':
+        size *= 1024;
+        end++;
+        break;
+    }
+    if (*end != '\0' || size == 0)
+        return -1;
+    *p_size = size;
+    return 0;
+}
+
+int store_parse_retention(const char *arg, store_config_t *p_config)
+{
+    static const struct
+    {
+        char suffix;
+        unsigned secs;
+    } units[] = {{'s', 1}, {'m', 60}, {'h', 3600}, {'d', 86400}};
+    char *end;
+
+    unsigned long n = strtoul(arg, &end, 10);
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++)
+    {
+        if (end != arg && n > 0 && end[0] == units[i].suffix && end[1] == '\0')
+        {
+            p_config->retain_secs = n * units[i].secs;
+            return 0;
+        }
+    }
+    return store_parse_size(arg, &p_config->retain_bytes);
+}
+
+// FNV-1a, continuing from hash
+static uint64_t ckpt_hash(uint64_t hash, const void *buf, size_t len)
+{
+    const unsigned char *p = buf;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ p[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+// Hash of the store bytes [from, end)
+static int ckpt_hash_tail(off_t from, off_t end, uint64_t *p_hash)
+{
+    char buf[CKPT_TAIL];
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    while (from < end)
+    {
+        size_t want = end - from < (off_t)sizeof(buf) ? (size_t)(end - from) : sizeof(buf);
+        ssize_t n = store_ops->read(from, buf, want);
+        if (n <= 0)
+            return -1;
+        hash = ckpt_hash(hash, buf, n);
+        from += n;
+    }
+    *p_hash = hash;
+    return 0;
+}
+
+// Read back the checkpoint of an earlier run and check that it still
+// describes the store just opened
+static int ckpt_load(record_index_mark_t *p_mark, uint64_t *p_generation)
+{
+    FILE *p_file = fopen(CHECKPOINT_FILE_PATH, "r");
+    char text[CKPT_TEXT_MAX];
+    char name[16];
+    unsigned long long gen, records, tail_hash, sum;
+    long long origin, committed, tail_from;
+    uint64_t hash;
+
+    if (!p_file)
+        return -1;
+    size_t len = fread(text, 1, sizeof(text) - 1, p_file);
+    fclose(p_file);
+    text[len] = '\0';
+
+    // Every line before the checksum is covered by it
+    char *p_sum = strstr(text, "checksum ");
+    if (!p_sum || sscanf(p_sum, "checksum %llx", &sum) != 1 ||
+        ckpt_hash(0xcbf29ce484222325ull, text, p_sum - text) != sum)
+    {
+        syslog(LOG_WARNING, "Checkpoint is damaged, starting cold");
+        return -1;
+    }
+    if (sscanf(text, "store %15s\ngeneration %llu\ncommitted %lld\nrecords %llu %lld\ntail %lld %llx\n", name,
+               &gen, &committed, &records, &origin, &tail_from, &tail_hash) != 7 ||
+        strcmp(name, store_ops->name) != 0)
+    {
+        syslog(LOG_WARNING, "Checkpoint is for another store, starting cold");
+        return -1;
+    }
+    if (committed > store_ops->size() || tail_from < store_start() ||
+        ckpt_hash_tail(tail_from, committed, &hash) != 0 || hash != tail_hash)
+    {
+        syslog(LOG_WARNING, "Store no longer matches its checkpoint, starting cold");
+        return -1;
+    }
+
+    p_mark->records = records;
+    p_mark->origin = origin;
+    p_mark->end = committed;
+    *p_generation = gen;
+    return 0;
+}
+
+int store_checkpoint(void)
+{
+    record_index_mark_t mark;
+    uint64_t hash;
+
+    if (store_sync() != 0 || record_index_mark(&mark) != 0)
+        return -1;
+    if (mark.end == ckpt_mark.end && mark.records == ckpt_mark.records)
+        return 0;
+
+    off_t tail_from = mark.end - CKPT_TAIL > store_start() ? mark.end - CKPT_TAIL : store_start();
+    if (ckpt_hash_tail(tail_from, mark.end, &hash) != 0)
+        return -1;
+
+    char text[CKPT_TEXT_MAX];
+    int len = snprintf(text, sizeof(text),
+                       "store %s\ngeneration %llu\ncommitted %lld\nrecords %llu %lld\ntail %lld %016llx\n",
+                       store_ops->name, (unsigned long long)generation, (long long)mark.end,
+                       (unsigned long long)mark.records, (long long)mark.origin, (long long)tail_from,
+                       (unsigned long long)hash);
+
+    FILE *p_file = fopen(CHECKPOINT_FILE_PATH ".tmp", "w");
+    if (!p_file)
+    {
+        syslog(LOG_ERR, "Failed to write checkpoint");
+        return -1;
+    }
+    fprintf(p_file, "%schecksum %016llx\n", text,
+            (unsigned long long)ckpt_hash(0xcbf29ce484222325ull, text, len));
+    int ret = fflush(p_file) == 0 && fsync(fileno(p_file)) == 0 ? 0 : -1;
+    fclose(p_file);
+    if (ret != 0 || rename(CHECKPOINT_FILE_PATH ".tmp", CHECKPOINT_FILE_PATH) != 0)
+    {
+        syslog(LOG_ERR, "Failed to install checkpoint");
+        return -1;
+    }
+    ckpt_mark = mark;
+    return 0;
+}
+
+int store_open(const store_config_t *p_config)
+{
+    store_config_t config = *p_config;
+    record_index_mark_t mark;
+    int warm = 0;
+
+    store_ops = store_backends[p_config->kind];
+    store_reply_mode = p_config->reply_mode;
+    if (p_config->compress && !zblock_available())
+    {
+        syslog(LOG_ERR, "Compression needs a build with ZLIB=1");
+        return -1;
+    }
+    if (p_config->compress && !store_ops->read_block)
+        syslog(LOG_WARNING, "The %s store cannot compress at rest, keeping it raw", store_ops->name);
+    if (config.checkpoint_ms && !store_ops->keepable)
+    {
+        syslog(LOG_WARNING, "The %s store does not outlive the process, starting cold", store_ops->name);
+        config.checkpoint_ms = 0;
+    }
+    // Checkpoints point into the persisted record index
+    if (config.checkpoint_ms)
+        config.persist_index = 1;
+    store_kept = config.checkpoint_ms != 0;
+
+    if (store_ops->open(&config) != 0)
+    {
+        syslog(LOG_ERR, "Failed to open %s store", store_ops->name);
+        return -1;
+    }
+    if (config.checkpoint_ms)
+        warm = ckpt_load(&mark, &generation) == 0;
+    if (record_index_open(config.persist_index, warm ? &mark : NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to build the record index");
+        store_ops->close();
+        return -1;
+    }
+    ckpt_mark = warm ? mark : (record_index_mark_t){0, 0, -1};
+    if (commit_open(&config) != 0)
+    {
+        record_index_close();
+        store_ops->close();
+        return -1;
+    }
+    // A fresh store gets a generation no earlier run can have handed out;
+    // a warm one keeps its own, so resume tokens stay valid
+    if (warm)
+        syslog(LOG_INFO, "Warm restart from checkpoint at %lld of %lld bytes", (long long)mark.end,
+               (long long)store_size());
+    else
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        generation = ((uint64_t)now.tv_sec * 1000000000u + now.tv_nsec) ^ ((uint64_t)getpid() << 48);
+    }
+
+    syslog(LOG_INFO, "Using %s store with %s replies", store_ops->name,
+           reply_mode_names[store_reply_mode]);
+    return 0;
+}
+
+void store_close(void)
+{
+    commit_close();
+    record_index_close();
+    store_ops->close();
+    zblock_cache_clear();
+    snapshot_clear();
+}
+
+void store_remove(void)
+{
+    if (store_kept)
+        return;
+    if (store_ops->remove)
+        store_ops->remove();
+    else
+        remove(DATA_FILE_PATH);
+    remove(INDEX_FILE_PATH);
+    remove(CHECKPOINT_FILE_PATH);
+}
+
+int store_append(const void *buf, size_t len)
+{
+    uint64_t start_ns = stats_now();
+    int ret = commit_append(buf, len);
+    stats_record(STAT_PHASE_COMMIT, stats_now() - start_ns);
+    return ret;
+}
+
+int store_write_batch(const struct iovec *iov, int iovcnt)
+{
+    if (store_ops->appendv(iov, iovcnt) != 0)
+        return -1;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (record_index_note(iov[i].iov_base, iov[i].iov_len) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+int store_sync(void)
+{
+    if (!store_ops->sync)
+        return 0;
+    pthread_mutex_lock(&sync_mutex);
+    int ret = store_ops->sync();
+    pthread_mutex_unlock(&sync_mutex);
+    return ret;
+}
+
+ssize_t store_read(off_t off, void *buf, size_t len)
+{
+    return store_ops->read(off, buf, len);
+}
+
+ssize_t store_send(int sock_fd, off_t off, size_t len)
+{
+    if (!store_zero_copy())
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return store_ops->send(sock_fd, off, len, store_reply_mode);
+}
+
+ssize_t store_read_block(uint64_t index, void *buf, size_t cap)
+{
+    return store_ops->read_block ? store_ops->read_block(index, buf, cap) : -1;
+}
+
+int store_zero_copy(void)
+{
+    return store_reply_mode != REPLY_COPY && store_ops->send != NULL;
+}
+
+int store_in_memory(void)
+{
+    return store_ops->in_memory;
+}
+
+uint64_t store_generation(void)
+{
+    return generation;
+}
+
+off_t store_size(void)
+{
+    return store_ops->size();
+}
+
+off_t store_start(void)
+{
+    return store_ops->start ? store_ops->start() : 0;
+}
+
+int store_seek(uint64_t record, uint64_t byte, off_t *p_off)
+{
+    off_t start, next;
+
+    if (record_index_lookup(record, &start, &next) != 0 || start < store_start())
+        return -1;
+    // The last record runs to the end of whatever is committed
+    if (next < 0)
+        next = store_size();
+    if (byte >= (uint64_t)(next - start))
+        return -1;
+    *p_off = start + byte;
+    return 0;
+}
+
+int store_fd(void)
+{
+    return store_ops->fd ? store_ops->fd() : -1;
+}
@@ -0,0 +1,152 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <stddef.h>
+#include <sys/uio.h>
+
+// Append-only record store behind every client reply.
+// Offsets are logical byte positions from the start of the log.
+typedef enum
+{
+    STORE_FILE,   // DATA_FILE_PATH is the store (legacy)
+    STORE_MEMORY, // segmented RAM buffer, optional write-behind to DATA_FILE_PATH
+    STORE_MMAP,   // DATA_FILE_PATH mapped and grown in preallocated extents
+    STORE_SEGMENTED, // fixed-size segment files with a manifest and retention
+    STORE_RING,      // the last ring_depth writes in RAM, like the AESD circular buffer
+} store_kind_t;
+
+// How replies move store bytes to the socket
+typedef enum
+{
+    REPLY_COPY,     // read into a user buffer, then send (legacy)
+    REPLY_SENDFILE, // zero-copy with sendfile() or straight from RAM
+    REPLY_SPLICE,   // zero-copy through a pipe with splice()
+} reply_mode_t;
+
+// When appended bytes are forced to stable storage
+typedef enum
+{
+    DURABLE_NONE,     // whenever the kernel writes them back (legacy)
+    DURABLE_INTERVAL, // fdatasync() every sync_interval_ms
+    DURABLE_BATCH,    // fdatasync() before a commit batch is acknowledged
+} durability_t;
+
+typedef struct
+{
+    store_kind_t kind;
+    reply_mode_t reply_mode;
+    durability_t durability;
+    unsigned sync_interval_ms;
+    int write_behind;
+    int persist_index; // keep the record index in INDEX_FILE_PATH too
+    off_t segment_size;
+    off_t retain_bytes;     // segmented store: drop old segments beyond this size
+    unsigned retain_secs;   // segmented store: drop segments sealed this long ago
+    int compress;           // segmented store: keep sealed segments block-compressed
+    size_t ring_depth;      // ring store: writes kept, 0 for the default
+    unsigned checkpoint_ms; // keep the store across restarts, checkpointing this often
+} store_config_t;
+
+#define STORE_SEGMENT_SIZE_DEFAULT ((off_t)64 * 1024 * 1024)
+
+int store_open(const store_config_t *p_config);
+void store_close(void);
+
+// After store_close(): delete the files the store and its index left
+// behind, unless it is kept for the next start
+void store_remove(void);
+
+// Append one chunk; concurrent appends never interleave within a chunk.
+// Concurrent callers are group committed, and the call returns once the
+// chunk is in the store and as durable as the configured policy asks.
+int store_append(const void *buf, size_t len);
+
+// Copy up to len bytes starting at off; returns 0 at the committed end
+ssize_t store_read(off_t off, void *buf, size_t len);
+
+// Send up to len bytes starting at off directly to a socket without a
+// user-space copy. Returns 0 at the committed end, or -1 with errno set;
+// EOPNOTSUPP means the caller must fall back to store_read().
+ssize_t store_send(int sock_fd, off_t off, size_t len);
+
+// Copy block index of zblock.h, compressed, into buf if the store already
+// keeps it that way at rest. Returns its length, or -1 when the caller has
+// to compress the raw bytes itself.
+ssize_t store_read_block(uint64_t index, void *buf, size_t cap);
+
+// Whether store_send() is worth trying for new replies
+int store_zero_copy(void);
+
+// Whether the store already lives in memory or is mapped, so a snapshot
+// of it would only double what it holds
+int store_in_memory(void);
+
+// Committed length of the store
+off_t store_size(void);
+
+// Offset of the oldest byte still retained. Bytes before it were dropped
+// by the retention policy and read as an ERANGE error.
+off_t store_start(void);
+
+// Offset of byte within record (both counted from 0), in constant time.
+// Fails unless the record exists and holds that byte.
+int store_seek(uint64_t record, uint64_t byte, off_t *p_off);
+
+// Identifies this incarnation of the store; offsets from another
+// generation mean nothing here
+uint64_t store_generation(void);
+
+// File descriptor the committed bytes can be read from at their logical
+// offsets, or -1 when the store is not backed by such a file
+int store_fd(void);
+
+int store_parse_kind(const char *name, store_kind_t *p_kind);
+int store_parse_reply_mode(const char *name, reply_mode_t *p_mode);
+// "none", "batch" or a sync interval in milliseconds
+int store_parse_durability(const char *name, store_config_t *p_config);
+// A byte count with an optional K, M or G suffix
+int store_parse_size(const char *arg, off_t *p_size);
+// A size as above, or an age with an s, m, h or d suffix
+int store_parse_retention(const char *arg, store_config_t *p_config);
+
+// Write one commit batch in order and keep the record index in step.
+// Only the commit stage calls these; it serializes them.
+int store_write_batch(const struct iovec *iov, int iovcnt);
+// Flush appended bytes to stable storage, if the backend can. Safe to call
+// from more than one thread; calls are serialized.
+int store_sync(void);
+// Sync the store and the record index and note in CHECKPOINT_FILE_PATH how
+// far both reach, so the next run starts from there instead of rescanning
+int store_checkpoint(void);
+
+/* ---------------------------
+   Backend interface
+   --------------------------- */
+
+typedef struct
+{
+    const char *name;
+    int keepable;  // what was committed is still there when opened again
+    int in_memory; // reads copy from RAM or a mapping already, so replies need no snapshot
+    int (*open)(const store_config_t *p_config);
+    void (*close)(void);
+    void (*remove)(void); // after close: delete its files, DATA_FILE_PATH if NULL
+    int (*appendv)(const struct iovec *iov, int iovcnt);
+    ssize_t (*read)(off_t off, void *buf, size_t len);
+    ssize_t (*send)(int sock_fd, off_t off, size_t len, reply_mode_t mode);
+    ssize_t (*read_block)(uint64_t index, void *buf, size_t cap);
+    off_t (*size)(void);
+    off_t (*start)(void);
+    int (*fd)(void);
+    int (*sync)(void);
+} store_ops_t;
+
+extern const store_ops_t store_file_ops;
+extern const store_ops_t store_mem_ops;
+extern const store_ops_t store_mmap_ops;
+extern const store_ops_t store_seg_ops;
+extern const store_ops_t store_ring_ops;
+
+#endif /* STORE_H */
@@ -0,0 +1,233 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include "aesdsocket.h"
+#include "store.h"
+
+// Legacy store: every chunk is appended straight to DATA_FILE_PATH
+static int data_fd = -1;
+static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Each replying thread splices through its own pipe
+static pthread_key_t pipe_key;
+static pthread_once_t pipe_key_once = PTHREAD_ONCE_INIT;
+#define SPLICE_CHUNK (64 * 1024)
+
+static int file_open(const store_config_t *p_config)
+{
+    (void)p_config;
+    data_fd = open(DATA_FILE_PATH, O_CREAT | O_RDWR | O_APPEND, 0644);
+    if (data_fd == -1)
+    {
+        syslog(LOG_ERR, "Failed to open data file");
+        return -1;
+    }
+    return 0;
+}
+
+static void file_close(void)
+{
+    if (data_fd >= 0)
+        close(data_fd);
+    data_fd = -1;
+}
+
+static int file_appendv(const struct iovec *iov, int iovcnt)
+{
+    struct iovec local[iovcnt];
+    struct iovec *p_iov = local;
+    int ret = 0;
+
+    memcpy(local, iov, iovcnt * sizeof(*iov));
+    pthread_mutex_lock(&file_mutex);
+    while (iovcnt > 0)
+    {
+        ssize_t n = writev(data_fd, p_iov, iovcnt > IOV_MAX ? IOV_MAX : iovcnt);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Failed to write data file");
+            ret = -1;
+            break;
+        }
+        // Skip what a short write took and resume mid-vector
+        while (iovcnt > 0 && (size_t)n >= p_iov->iov_len)
+        {
+            n -= p_iov->iov_len;
+            p_iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            p_iov->iov_base = (char *)p_iov->iov_base + n;
+            p_iov->iov_len -= n;
+        }
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return ret;
+}
+
+static int file_sync(void)
+{
+    if (fdatasync(data_fd) != 0)
+    {
+        syslog(LOG_ERR, "Failed to sync data file");
+        return -1;
+    }
+    return 0;
+}
+
+static ssize_t file_read(off_t off, void *buf, size_t len)
+{
+    ssize_t n;
+
+    do
+        n = pread(data_fd, buf, len, off);
+    while (n < 0 && errno == EINTR);
+    return n;
+}
+
+static void pipe_destroy(void *p)
+{
+    int *p_pipe = p;
+    close(p_pipe[0]);
+    close(p_pipe[1]);
+    free(p_pipe);
+}
+
+static void pipe_key_create(void)
+{
+    pthread_key_create(&pipe_key, pipe_destroy);
+}
+
+static int *thread_pipe(void)
+{
+    pthread_once(&pipe_key_once, pipe_key_create);
+
+    int *p_pipe = pthread_getspecific(pipe_key);
+    if (p_pipe)
+        return p_pipe;
+
+    p_pipe = malloc(2 * sizeof(int));
+    if (!p_pipe)
+        return NULL;
+    if (pipe2(p_pipe, O_CLOEXEC) != 0)
+    {
+        free(p_pipe);
+        return NULL;
+    }
+    pthread_setspecific(pipe_key, p_pipe);
+    return p_pipe;
+}
+
+// Bytes that reached the pipe but not the socket are discarded: the caller
+// only advances by what was sent and splices them again next time, so the
+// pipe is always empty between calls.
+static void pipe_discard(int pipe_rd, size_t len)
+{
+    char scratch[BUF_SIZE];
+
+    while (len > 0)
+    {
+        ssize_t n = read(pipe_rd, scratch, len < sizeof(scratch) ? len : sizeof(scratch));
+        if (n <= 0)
+        {
+            if (n < 0 && errno == EINTR)
+                continue;
+            break;
+        }
+        len -= n;
+    }
+}
+
+static ssize_t file_splice(int sock_fd, off_t off, size_t len)
+{
+    int *p_pipe = thread_pipe();
+    if (!p_pipe)
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    if (len > SPLICE_CHUNK)
+        len = SPLICE_CHUNK;
+
+    ssize_t in = splice(data_fd, &off, p_pipe[1], NULL, len, SPLICE_F_MOVE);
+    if (in <= 0)
+    {
+        if (in < 0 && errno == EINVAL)
+            errno = EOPNOTSUPP;
+        return in;
+    }
+
+    ssize_t sent = 0;
+    while (sent < in)
+    {
+        ssize_t out = splice(p_pipe[0], NULL, sock_fd, NULL, in - sent,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (out < 0 && errno == EINTR)
+            continue;
+        if (out <= 0)
+            break;
+        sent += out;
+    }
+
+    if (sent < in)
+    {
+        int saved_errno = errno;
+        pipe_discard(p_pipe[0], in - sent);
+        errno = saved_errno;
+        if (sent == 0)
+            return -1;
+    }
+    return sent;
+}
+
+static ssize_t file_send(int sock_fd, off_t off, size_t len, reply_mode_t mode)
+{
+    if (mode == REPLY_SPLICE)
+        return file_splice(sock_fd, off, len);
+
+    ssize_t n = sendfile(sock_fd, data_fd, &off, len);
+    if (n < 0 && (errno == EINVAL || errno == ENOSYS))
+        errno = EOPNOTSUPP;
+    return n;
+}
+
+static off_t file_size(void)
+{
+    struct stat st;
+    if (fstat(data_fd, &st) != 0)
+        return -1;
+    return st.st_size;
+}
+
+static int file_fd(void)
+{
+    return data_fd;
+}
+
+const store_ops_t store_file_ops = {
+    .name = "file",
+    .keepable = 1,
+    .open = file_open,
+    .close = file_close,
+    .appendv = file_appendv,
+    .read = file_read,
+    .send = file_send,
+    .size = file_size,
+    .fd = file_fd,
+    .sync = file_sync,
+};
@@ -0,0 +1,278 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "store.h"
+
+// In-memory store: the log lives in fixed-size segments reached through a
+// segment table. Appends are serialized by mem_mutex and publish the new
+// committed length with release semantics, so readers copy out of RAM
+// without taking any lock. A grown segment table replaces the old one
+// atomically; old tables stay allocated until close so a reader holding
+// one never sees it freed.
+#define SEG_SHIFT 20
+#define SEG_SIZE ((off_t)1 << SEG_SHIFT)
+#define SEG_TABLE_MIN 16
+#define MAX_RETIRED_TABLES 48
+
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_cond = PTHREAD_COND_INITIALIZER;
+static _Atomic(char **) seg_table;
+static _Atomic off_t committed;
+static char **retired_tables[MAX_RETIRED_TABLES];
+static size_t retired_count;
+static size_t seg_cap;
+static size_t seg_count;
+static off_t write_off;
+
+// Write-behind persistence, owned by the flusher thread
+static int persist_fd = -1;
+static int closing;
+static pthread_t flusher_tid;
+
+static int mem_add_segment(void)
+{
+    char **table = atomic_load_explicit(&seg_table, memory_order_relaxed);
+
+    if (seg_count == seg_cap)
+    {
+        if (retired_count == MAX_RETIRED_TABLES)
+            return -1;
+
+        size_t new_cap = seg_cap ? seg_cap * 2 : SEG_TABLE_MIN;
+        char **new_table = calloc(new_cap, sizeof(char *));
+        if (!new_table)
+            return -1;
+        if (table)
+        {
+            memcpy(new_table, table, seg_count * sizeof(char *));
+            retired_tables[retired_count++] = table;
+        }
+        table = new_table;
+        seg_cap = new_cap;
+        atomic_store_explicit(&seg_table, table, memory_order_release);
+    }
+
+    table[seg_count] = malloc(SEG_SIZE);
+    if (!table[seg_count])
+        return -1;
+    seg_count++;
+    return 0;
+}
+
+// Copy [off, off + len) of the log, which the caller knows is committed
+static void mem_copy_out(char **table, off_t off, char *dst, size_t len)
+{
+    while (len > 0)
+    {
+        size_t seg_off = off & (SEG_SIZE - 1);
+        size_t chunk = SEG_SIZE - seg_off;
+        if (chunk > len)
+            chunk = len;
+        memcpy(dst, table[off >> SEG_SHIFT] + seg_off, chunk);
+        off += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+}
+
+static int persist_range(off_t off, off_t end)
+{
+    char **table = atomic_load_explicit(&seg_table, memory_order_acquire);
+
+    while (off < end)
+    {
+        size_t seg_off = off & (SEG_SIZE - 1);
+        size_t chunk = SEG_SIZE - seg_off;
+        if ((off_t)chunk > end - off)
+            chunk = end - off;
+
+        ssize_t n = write(persist_fd, table[off >> SEG_SHIFT] + seg_off, chunk);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        off += n;
+    }
+    return 0;
+}
+
+static void *mem_flusher_thread(void *arg)
+{
+    (void)arg;
+    off_t persisted = 0;
+
+    for (;;)
+    {
+        pthread_mutex_lock(&mem_mutex);
+        while (persisted == write_off && !closing)
+            pthread_cond_wait(&mem_cond, &mem_mutex);
+        off_t end = write_off;
+        pthread_mutex_unlock(&mem_mutex);
+
+        if (persisted == end)
+            break;
+
+        if (persist_range(persisted, end) != 0)
+        {
+            syslog(LOG_ERR, "Write-behind to data file failed, persistence disabled");
+            break;
+        }
+        persisted = end;
+    }
+    return NULL;
+}
+
+static int mem_open(const store_config_t *p_config)
+{
+    closing = 0;
+    write_off = 0;
+    atomic_store(&committed, 0);
+
+    if (!p_config->write_behind)
+        return 0;
+
+    // RAM is the source of truth, so the file restarts with it
+    persist_fd = open(DATA_FILE_PATH, O_CREAT | O_WRONLY | O_TRUNC | O_APPEND, 0644);
+    if (persist_fd == -1)
+    {
+        syslog(LOG_ERR, "Failed to open data file");
+        return -1;
+    }
+
+    if (pthread_create(&flusher_tid, NULL, mem_flusher_thread, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to create write-behind thread");
+        close(persist_fd);
+        persist_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void mem_close(void)
+{
+    if (persist_fd >= 0)
+    {
+        pthread_mutex_lock(&mem_mutex);
+        closing = 1;
+        pthread_cond_signal(&mem_cond);
+        pthread_mutex_unlock(&mem_mutex);
+
+        pthread_join(flusher_tid, NULL);
+        close(persist_fd);
+        persist_fd = -1;
+    }
+
+    char **table = atomic_load(&seg_table);
+    for (size_t i = 0; i < seg_count; i++)
+        free(table[i]);
+    free(table);
+    for (size_t i = 0; i < retired_count; i++)
+        free(retired_tables[i]);
+
+    atomic_store(&seg_table, NULL);
+    retired_count = 0;
+    seg_cap = 0;
+    seg_count = 0;
+}
+
+static int mem_appendv(const struct iovec *iov, int iovcnt)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&mem_mutex);
+    off_t off = write_off;
+    for (int i = 0; i < iovcnt && ret == 0; i++)
+    {
+        const char *src = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        while (len > 0)
+        {
+            if ((size_t)(off >> SEG_SHIFT) == seg_count && mem_add_segment() != 0)
+            {
+                syslog(LOG_ERR, "Memory store allocation failed");
+                ret = -1;
+                break;
+            }
+
+            char **table = atomic_load_explicit(&seg_table, memory_order_relaxed);
+            size_t seg_off = off & (SEG_SIZE - 1);
+            size_t chunk = SEG_SIZE - seg_off;
+            if (chunk > len)
+                chunk = len;
+            memcpy(table[off >> SEG_SHIFT] + seg_off, src, chunk);
+            off += chunk;
+            src += chunk;
+            len -= chunk;
+        }
+    }
+
+    // A failed append publishes nothing, so readers never see a torn batch
+    if (ret == 0)
+    {
+        write_off = off;
+        atomic_store_explicit(&committed, off, memory_order_release);
+        if (persist_fd >= 0)
+            pthread_cond_signal(&mem_cond);
+    }
+    pthread_mutex_unlock(&mem_mutex);
+    return ret;
+}
+
+static ssize_t mem_read(off_t off, void *buf, size_t len)
+{
+    off_t end = atomic_load_explicit(&committed, memory_order_acquire);
+    if (off >= end)
+        return 0;
+    if ((off_t)len > end - off)
+        len = end - off;
+
+    mem_copy_out(atomic_load_explicit(&seg_table, memory_order_acquire), off, buf, len);
+    return len;
+}
+
+// Replies go straight from the segment, one segment per call
+static ssize_t mem_send(int sock_fd, off_t off, size_t len, reply_mode_t mode)
+{
+    (void)mode;
+    off_t end = atomic_load_explicit(&committed, memory_order_acquire);
+    if (off >= end)
+        return 0;
+    if ((off_t)len > end - off)
+        len = end - off;
+
+    char **table = atomic_load_explicit(&seg_table, memory_order_acquire);
+    size_t seg_off = off & (SEG_SIZE - 1);
+    if (len > SEG_SIZE - seg_off)
+        len = SEG_SIZE - seg_off;
+    return send(sock_fd, table[off >> SEG_SHIFT] + seg_off, len, MSG_NOSIGNAL);
+}
+
+static off_t mem_size(void)
+{
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+const store_ops_t store_mem_ops = {
+    .name = "mem",
+    .in_memory = 1,
+    .open = mem_open,
+    .close = mem_close,
+    .appendv = mem_appendv,
+    .read = mem_read,
+    .send = mem_send,
+    .size = mem_size,
+};
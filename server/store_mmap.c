@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "store.h"
+
+// Mapped store: DATA_FILE_PATH is mapped once over a large reserved range
+// and its blocks are preallocated underneath the mapping in large extents,
+// so addresses never move. The extents are reserved without growing the
+// file, and appends write through the fd, so the file size is exactly what
+// was appended, even after an unclean stop. The committed length is then
+// published with release semantics; readers copy or send straight from the
+// mapping up to that watermark without any lock.
+#define MAP_EXTENT ((off_t)64 * 1024 * 1024)
+#if SIZE_MAX > UINT32_MAX
+#define MAP_RESERVE_MAX ((size_t)1 << 36)
+#define MAP_RESERVE_MIN ((size_t)1 << 30)
+#else
+// A 32-bit process has no room for more than part of its address space
+#define MAP_RESERVE_MAX ((size_t)1 << 30)
+#define MAP_RESERVE_MIN ((size_t)MAP_EXTENT)
+#endif
+
+static int data_fd = -1;
+static char *map_base;
+static size_t map_reserved;
+static pthread_mutex_t map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static off_t alloc_len; // blocks reserved, at or past the file size
+static off_t write_off;
+static _Atomic off_t committed;
+static off_t synced_off; // under store_sync()'s lock
+
+// Reserve blocks for [0, need) of the file without changing its size
+static int mmap_reserve(off_t need)
+{
+    if (need <= alloc_len)
+        return 0;
+    if ((size_t)need > map_reserved)
+    {
+        syslog(LOG_ERR, "Mapped store is full");
+        return -1;
+    }
+
+    off_t new_len = (need + MAP_EXTENT - 1) / MAP_EXTENT * MAP_EXTENT;
+    if ((size_t)new_len > map_reserved)
+        new_len = map_reserved;
+
+    // Without preallocation, blocks are allocated as appends reach them
+    if (fallocate(data_fd, FALLOC_FL_KEEP_SIZE, alloc_len, new_len - alloc_len) != 0 && errno != EOPNOTSUPP)
+    {
+        syslog(LOG_ERR, "Failed to extend data file: %s", strerror(errno));
+        return -1;
+    }
+    alloc_len = new_len;
+    return 0;
+}
+
+static int mmap_pwrite_all(const char *buf, size_t len, off_t off)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(data_fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int mmap_open(const store_config_t *p_config)
+{
+    (void)p_config;
+    struct stat st;
+
+    data_fd = open(DATA_FILE_PATH, O_CREAT | O_RDWR, 0644);
+    if (data_fd == -1 || fstat(data_fd, &st) != 0)
+    {
+        syslog(LOG_ERR, "Failed to open data file");
+        return -1;
+    }
+
+    // Pages past the end of the file are never touched, so mapping far
+    // beyond it only costs address space
+    for (map_reserved = MAP_RESERVE_MAX; map_reserved >= MAP_RESERVE_MIN; map_reserved /= 2)
+    {
+        map_base = mmap(NULL, map_reserved, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_NORESERVE,
+                        data_fd, 0);
+        if (map_base != MAP_FAILED)
+            break;
+    }
+    if (map_base == MAP_FAILED)
+    {
+        syslog(LOG_ERR, "Failed to map data file");
+        map_base = NULL;
+        close(data_fd);
+        data_fd = -1;
+        return -1;
+    }
+
+    // Whatever the file already holds was appended
+    alloc_len = st.st_size;
+    write_off = st.st_size;
+    atomic_store(&committed, write_off);
+    synced_off = 0;
+    return 0;
+}
+
+static void mmap_close(void)
+{
+    if (map_base)
+        munmap(map_base, map_reserved);
+    map_base = NULL;
+
+    if (data_fd >= 0)
+    {
+        // Drops whatever a failed append left past the committed length
+        if (ftruncate(data_fd, write_off) != 0)
+            syslog(LOG_ERR, "Failed to trim data file");
+        close(data_fd);
+    }
+    data_fd = -1;
+}
+
+static int mmap_appendv(const struct iovec *iov, int iovcnt)
+{
+    size_t len = 0;
+    int ret = 0;
+
+    for (int i = 0; i < iovcnt; i++)
+        len += iov[i].iov_len;
+
+    pthread_mutex_lock(&map_mutex);
+    if (mmap_reserve(write_off + len) != 0)
+        ret = -1;
+    else
+    {
+        // The bytes show up in the mapping through the shared page cache
+        off_t off = write_off;
+        for (int i = 0; i < iovcnt && ret == 0; i++)
+        {
+            ret = mmap_pwrite_all(iov[i].iov_base, iov[i].iov_len, off);
+            off += iov[i].iov_len;
+        }
+        if (ret == 0)
+        {
+            write_off = off;
+            atomic_store_explicit(&committed, write_off, memory_order_release);
+        }
+        else
+            syslog(LOG_ERR, "Failed to write data file");
+    }
+    pthread_mutex_unlock(&map_mutex);
+    return ret;
+}
+
+static ssize_t mmap_read(off_t off, void *buf, size_t len)
+{
+    off_t end = atomic_load_explicit(&committed, memory_order_acquire);
+    if (off >= end)
+        return 0;
+    if ((off_t)len > end - off)
+        len = end - off;
+
+    memcpy(buf, map_base + off, len);
+    return len;
+}
+
+// Replies go straight from the mapping
+static ssize_t mmap_send(int sock_fd, off_t off, size_t len, reply_mode_t mode)
+{
+    (void)mode;
+    off_t end = atomic_load_explicit(&committed, memory_order_acquire);
+    if (off >= end)
+        return 0;
+    if ((off_t)len > end - off)
+        len = end - off;
+
+    return send(sock_fd, map_base + off, len, MSG_NOSIGNAL);
+}
+
+static off_t mmap_size(void)
+{
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+static int mmap_fd(void)
+{
+    return data_fd;
+}
+
+static int mmap_sync(void)
+{
+    off_t end = atomic_load_explicit(&committed, memory_order_acquire);
+    off_t from = synced_off & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+
+    if (end > from && msync(map_base + from, end - from, MS_SYNC) != 0)
+    {
+        syslog(LOG_ERR, "Failed to sync data file");
+        return -1;
+    }
+    synced_off = end;
+    return 0;
+}
+
+const store_ops_t store_mmap_ops = {
+    .name = "mmap",
+    .keepable = 1,
+    .in_memory = 1,
+    .open = mmap_open,
+    .close = mmap_close,
+    .appendv = mmap_appendv,
+    .read = mmap_read,
+    .send = mmap_send,
+    .size = mmap_size,
+    .fd = mmap_fd,
+    .sync = mmap_sync,
+};
@@ -0,0 +1,192 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+#include "store.h"
+
+// Circular-buffer store, after the AESD char driver: only the last depth
+// write commands are kept, each in its own allocation, oldest at out_offs.
+// Inserting into a full ring overwrites the oldest entry in constant time,
+// so the data held is bounded by the depth (and by retain_bytes, if set)
+// and no file is ever touched. Logical offsets keep counting across
+// overwrites; what was overwritten reads as ERANGE like anything dropped by
+// retention, and the record index frees the blocks that covered it.
+// Readers copy under ring_lock held shared; the flusher inserts exclusively.
+// Replies copy straight from the entries rather than from a snapshot.
+#define RING_DEPTH_DEFAULT 10 // AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+
+typedef struct
+{
+    char *buf;
+    size_t size;
+    off_t off; // logical offset of the first byte
+} ring_entry_t;
+
+static pthread_rwlock_t ring_lock = PTHREAD_RWLOCK_INITIALIZER;
+static ring_entry_t *entries;
+static size_t depth;
+static size_t out_offs; // oldest entry
+static size_t count;
+static off_t held_bytes;
+static off_t retain_bytes;
+static _Atomic off_t start;
+static _Atomic off_t committed;
+
+#define RING_ENTRY(i) (&entries[(out_offs + (i)) % depth])
+
+static int ring_open(const store_config_t *p_config)
+{
+    depth = p_config->ring_depth ? p_config->ring_depth : RING_DEPTH_DEFAULT;
+    retain_bytes = p_config->retain_bytes;
+    entries = calloc(depth, sizeof(ring_entry_t));
+    if (!entries)
+        return -1;
+    out_offs = 0;
+    count = 0;
+    held_bytes = 0;
+    atomic_store(&start, 0);
+    atomic_store(&committed, 0);
+    syslog(LOG_INFO, "Ring store keeps the last %zu writes", depth);
+    return 0;
+}
+
+static void ring_close(void)
+{
+    for (size_t i = 0; i < count; i++)
+        free(RING_ENTRY(i)->buf);
+    free(entries);
+    entries = NULL;
+    count = 0;
+}
+
+// Drop the oldest entry; ring_lock is held exclusively
+static void ring_evict(void)
+{
+    ring_entry_t *p_entry = RING_ENTRY(0);
+    held_bytes -= p_entry->size;
+    free(p_entry->buf);
+    p_entry->buf = NULL;
+    out_offs = (out_offs + 1) % depth;
+    count--;
+}
+
+static int ring_appendv(const struct iovec *iov, int iovcnt)
+{
+    int ret = 0;
+
+    pthread_rwlock_wrlock(&ring_lock);
+    off_t off = atomic_load(&committed);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        if (iov[i].iov_len == 0)
+            continue;
+        char *buf = malloc(iov[i].iov_len);
+        if (!buf)
+        {
+            syslog(LOG_ERR, "Ring store allocation failed");
+            ret = -1;
+            break;
+        }
+        memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+
+        if (count == depth)
+            ring_evict();
+        ring_entry_t *p_entry = RING_ENTRY(count);
+        p_entry->buf = buf;
+        p_entry->size = iov[i].iov_len;
+        p_entry->off = off;
+        count++;
+        held_bytes += p_entry->size;
+        off += p_entry->size;
+
+        // The newest write always stays, whatever its size
+        while (retain_bytes && held_bytes > retain_bytes && count > 1)
+            ring_evict();
+    }
+    atomic_store(&start, count ? RING_ENTRY(0)->off : off);
+    atomic_store_explicit(&committed, off, memory_order_release);
+    pthread_rwlock_unlock(&ring_lock);
+    return ret;
+}
+
+// Entry holding logical offset fpos and fpos's offset within it, or NULL
+// if fpos was overwritten or is not written yet. ring_lock must be held.
+static ring_entry_t *find_entry_offset_for_fpos(off_t fpos, size_t *p_entry_offset)
+{
+    size_t lo = 0;
+    size_t hi = count;
+
+    if (count == 0 || fpos < RING_ENTRY(0)->off || fpos >= atomic_load(&committed))
+        return NULL;
+    // Entries are in offset order from the oldest: last one starting at or before fpos
+    while (hi - lo > 1)
+    {
+        size_t mid = (lo + hi) / 2;
+        if (RING_ENTRY(mid)->off <= fpos)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    *p_entry_offset = fpos - RING_ENTRY(lo)->off;
+    return RING_ENTRY(lo);
+}
+
+// Walk the ring from off, copying across as many entries as len spans
+static ssize_t ring_read(off_t off, void *buf, size_t len)
+{
+    size_t entry_offset;
+    size_t copied = 0;
+
+    pthread_rwlock_rdlock(&ring_lock);
+    if (off >= atomic_load(&committed))
+    {
+        pthread_rwlock_unlock(&ring_lock);
+        return 0;
+    }
+    ring_entry_t *p_entry = find_entry_offset_for_fpos(off, &entry_offset);
+    if (!p_entry)
+    {
+        pthread_rwlock_unlock(&ring_lock);
+        errno = ERANGE;
+        return -1;
+    }
+
+    size_t i = (p_entry - entries + depth - out_offs) % depth;
+    for (; i < count && copied < len; i++, entry_offset = 0)
+    {
+        p_entry = RING_ENTRY(i);
+        size_t chunk = p_entry->size - entry_offset;
+        if (chunk > len - copied)
+            chunk = len - copied;
+        memcpy((char *)buf + copied, p_entry->buf + entry_offset, chunk);
+        copied += chunk;
+    }
+    pthread_rwlock_unlock(&ring_lock);
+    return copied;
+}
+
+static off_t ring_size(void)
+{
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+static off_t ring_start(void)
+{
+    return atomic_load(&start);
+}
+
+const store_ops_t store_ring_ops = {
+    .name = "ring",
+    .in_memory = 1,
+    .open = ring_open,
+    .close = ring_close,
+    .appendv = ring_appendv,
+    .read = ring_read,
+    .size = ring_size,
+    .start = ring_start,
+};
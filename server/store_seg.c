@@ -0,0 +1,796 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "store.h"
+#include "zblock.h"
+
+// Segmented store: the log is cut into files of exactly segment_size bytes,
+// so segment seq holds logical offsets [seq * size, (seq + 1) * size) and
+// finding one is arithmetic. Only the flusher appends; it writes the active
+// segment without locks and swaps in a segment the maintenance thread has
+// already created when it crosses a boundary. The maintenance thread also
+// applies retention and rewrites the manifest, so neither file creation,
+// deletion nor the manifest ever stalls ingest. Readers hold seg_lock
+// shared while they use a segment's descriptor, which keeps retention from
+// closing it under them.
+//
+// With compression on, the maintenance thread also rewrites every sealed
+// segment as zblock.h blocks compressed one by one, followed by a table of
+// where each block starts, and drops the raw file once the manifest lists
+// the compressed one. Reads expand one block at a time; compressed replies
+// take the blocks as they are stored.
+#define SEG_SLOTS 65536
+#define SEG_MAINT_PERIOD_SEC 1
+#define SEG_PATH_MAX 128
+
+typedef struct
+{
+    int fd;            // raw segment file, -1 once compressed
+    int zfd;           // compressed segment file, or -1
+    uint64_t *p_zoffs; // start of each block in zfd, then its end
+    time_t sealed_at;  // 0 while the segment is still being written
+} segment_t;
+
+static segment_t segs[SEG_SLOTS];
+static pthread_rwlock_t seg_lock = PTHREAD_RWLOCK_INITIALIZER;
+static off_t seg_size;
+static _Atomic uint64_t first_seq;
+static _Atomic uint64_t active_seq;
+static off_t write_off;
+static _Atomic off_t committed;
+static uint64_t synced_seq; // under store_sync()'s lock
+static int seg_compressing;
+static uint64_t compress_seq; // next segment to compress, maintenance thread only
+
+// Retention policy; zero disables a limit
+static off_t retain_bytes;
+static unsigned retain_secs;
+
+// Maintenance thread state, under maint_mutex
+static pthread_mutex_t maint_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maint_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t maint_tid;
+static int spare_fd = -1;
+static uint64_t spare_seq;
+static int manifest_dirty;
+static int closing;
+
+#define SEG(seq) (&segs[(seq) % SEG_SLOTS])
+
+static void seg_path(uint64_t seq, char *path)
+{
+    snprintf(path, SEG_PATH_MAX, DATA_FILE_PATH ".%06llu", (unsigned long long)seq);
+}
+
+static void seg_zpath(uint64_t seq, char *path)
+{
+    snprintf(path, SEG_PATH_MAX, DATA_FILE_PATH ".%06llu.z", (unsigned long long)seq);
+}
+
+static int seg_pread_all(int fd, void *buf, size_t len, off_t off)
+{
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (char *)buf + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static int seg_pwrite_all(int fd, const void *buf, size_t len, off_t off)
+{
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf = (const char *)buf + n;
+        len -= n;
+        off += n;
+    }
+    return 0;
+}
+
+static size_t seg_blocks(off_t size)
+{
+    return size / ZBLOCK_SIZE;
+}
+
+// Block table of a compressed segment file; it sits at the end
+static uint64_t *seg_load_zoffs(int zfd, off_t size)
+{
+    size_t table_len = (seg_blocks(size) + 1) * sizeof(uint64_t);
+    struct stat st;
+
+    if (fstat(zfd, &st) != 0 || (size_t)st.st_size < table_len)
+        return NULL;
+    uint64_t *p_zoffs = malloc(table_len);
+    if (p_zoffs && seg_pread_all(zfd, p_zoffs, table_len, st.st_size - table_len) != 0)
+    {
+        free(p_zoffs);
+        p_zoffs = NULL;
+    }
+    return p_zoffs;
+}
+
+static int seg_create(uint64_t seq)
+{
+    char path[SEG_PATH_MAX];
+    seg_path(seq, path);
+    // A file left from before a crash is no segment the manifest knows of
+    int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd == -1)
+    {
+        syslog(LOG_ERR, "Failed to create segment %s", path);
+        return -1;
+    }
+    // Reserve the blocks up front without changing the size recovery reads
+    fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, seg_size);
+    return fd;
+}
+
+static void seg_write_manifest(void)
+{
+    FILE *p_file = fopen(MANIFEST_FILE_PATH ".tmp", "w");
+    if (!p_file)
+    {
+        syslog(LOG_ERR, "Failed to write segment manifest");
+        return;
+    }
+
+    pthread_rwlock_rdlock(&seg_lock);
+    uint64_t first = atomic_load(&first_seq);
+    uint64_t active = atomic_load(&active_seq);
+    fprintf(p_file, "segment_size %lld\n", (long long)seg_size);
+    for (uint64_t seq = first; seq <= active; seq++)
+        fprintf(p_file, "segment %llu %lld%s\n", (unsigned long long)seq, (long long)SEG(seq)->sealed_at,
+                SEG(seq)->zfd >= 0 ? " z" : "");
+    pthread_rwlock_unlock(&seg_lock);
+
+    if (fflush(p_file) != 0 || fsync(fileno(p_file)) != 0)
+        syslog(LOG_ERR, "Failed to flush segment manifest");
+    fclose(p_file);
+    if (rename(MANIFEST_FILE_PATH ".tmp", MANIFEST_FILE_PATH) != 0)
+        syslog(LOG_ERR, "Failed to install segment manifest");
+}
+
+// Oldest sealed segment, if the policy says it has to go
+static int seg_expired(uint64_t first, time_t now)
+{
+    if (first >= atomic_load(&active_seq))
+        return 0;
+    if (retain_bytes && atomic_load(&committed) - (off_t)first * seg_size > retain_bytes)
+        return 1;
+    return retain_secs && SEG(first)->sealed_at + (time_t)retain_secs < now;
+}
+
+static int seg_apply_retention(void)
+{
+    time_t now = time(NULL);
+    int dropped = 0;
+
+    for (;;)
+    {
+        pthread_rwlock_wrlock(&seg_lock);
+        uint64_t first = atomic_load(&first_seq);
+        if (!seg_expired(first, now))
+        {
+            pthread_rwlock_unlock(&seg_lock);
+            break;
+        }
+        int fd = SEG(first)->fd;
+        int zfd = SEG(first)->zfd;
+        free(SEG(first)->p_zoffs);
+        SEG(first)->fd = -1;
+        SEG(first)->zfd = -1;
+        SEG(first)->p_zoffs = NULL;
+        atomic_store(&first_seq, first + 1);
+        pthread_rwlock_unlock(&seg_lock);
+
+        char path[SEG_PATH_MAX];
+        seg_path(first, path);
+        if (fd >= 0)
+            close(fd);
+        unlink(path);
+        seg_zpath(first, path);
+        if (zfd >= 0)
+            close(zfd);
+        unlink(path);
+        dropped++;
+    }
+    if (dropped)
+        syslog(LOG_INFO, "Retention dropped %d segment(s)", dropped);
+    return dropped;
+}
+
+// Rewrite sealed segment seq as compressed blocks, then drop the raw file
+static int seg_compress_one(uint64_t seq)
+{
+    size_t nblocks = seg_blocks(seg_size);
+    size_t cap = zblock_bound(ZBLOCK_SIZE);
+    uint64_t *p_zoffs = malloc((nblocks + 1) * sizeof(uint64_t));
+    char *raw = malloc(ZBLOCK_SIZE);
+    unsigned char *z = malloc(cap);
+    int fd = SEG(seq)->fd; // only this thread ever closes it
+    char path[SEG_PATH_MAX];
+    int zfd = -1;
+    uint64_t zoff = 0;
+
+    seg_zpath(seq, path);
+    if (p_zoffs && raw && z)
+        zfd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+    for (size_t i = 0; zfd >= 0 && i < nblocks; i++)
+    {
+        size_t z_len = cap;
+        if (seg_pread_all(fd, raw, ZBLOCK_SIZE, (off_t)i * ZBLOCK_SIZE) != 0 ||
+            zblock_compress(raw, ZBLOCK_SIZE, z, &z_len) != 0 || seg_pwrite_all(zfd, z, z_len, zoff) != 0)
+        {
+            close(zfd);
+            zfd = -1;
+            break;
+        }
+        p_zoffs[i] = zoff;
+        zoff += z_len;
+    }
+    if (zfd >= 0)
+    {
+        p_zoffs[nblocks] = zoff;
+        if (seg_pwrite_all(zfd, p_zoffs, (nblocks + 1) * sizeof(uint64_t), zoff) != 0 || fdatasync(zfd) != 0)
+        {
+            close(zfd);
+            zfd = -1;
+        }
+    }
+    free(raw);
+    free(z);
+    if (zfd < 0)
+    {
+        syslog(LOG_ERR, "Failed to compress segment %llu, keeping it raw", (unsigned long long)seq);
+        unlink(path);
+        free(p_zoffs);
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&seg_lock);
+    SEG(seq)->zfd = zfd;
+    SEG(seq)->p_zoffs = p_zoffs;
+    SEG(seq)->fd = -1;
+    pthread_rwlock_unlock(&seg_lock);
+
+    // The raw file goes only once a crash would find the compressed one
+    seg_write_manifest();
+    seg_path(seq, path);
+    close(fd);
+    unlink(path);
+    return 0;
+}
+
+// Compress the oldest sealed segment still raw. Returns 1 if there may be
+// more to do.
+static int seg_compress_next(void)
+{
+    if (!seg_compressing)
+        return 0;
+    if (compress_seq < atomic_load(&first_seq))
+        compress_seq = atomic_load(&first_seq);
+    if (compress_seq >= atomic_load(&active_seq))
+        return 0;
+
+    uint64_t seq = compress_seq++;
+    if (SEG(seq)->zfd < 0)
+        seg_compress_one(seq);
+    return 1;
+}
+
+static void *seg_maint_thread(void *arg)
+{
+    (void)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&maint_mutex);
+    while (!closing)
+    {
+        // Keep the next segment ready before the flusher needs it
+        uint64_t next = atomic_load(&active_seq) + 1;
+        if (spare_fd >= 0 && spare_seq < next)
+        {
+            close(spare_fd); // the flusher had to make that one itself
+            spare_fd = -1;
+        }
+        if (spare_fd < 0)
+        {
+            pthread_mutex_unlock(&maint_mutex);
+            int fd = seg_create(next);
+            pthread_mutex_lock(&maint_mutex);
+            spare_fd = fd;
+            spare_seq = next;
+        }
+
+        int write_manifest = manifest_dirty;
+        manifest_dirty = 0;
+        pthread_mutex_unlock(&maint_mutex);
+
+        if (seg_apply_retention() > 0)
+            write_manifest = 1;
+        if (write_manifest)
+            seg_write_manifest();
+        int more = seg_compress_next();
+
+        pthread_mutex_lock(&maint_mutex);
+        if (closing || manifest_dirty || more)
+            continue;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += SEG_MAINT_PERIOD_SEC;
+        pthread_cond_timedwait(&maint_cond, &maint_mutex, &deadline);
+    }
+    pthread_mutex_unlock(&maint_mutex);
+    return NULL;
+}
+
+// Reopen the segments a previous run listed in the manifest
+static int seg_load_manifest(void)
+{
+    FILE *p_file = fopen(MANIFEST_FILE_PATH, "r");
+    char line[128];
+    long long size = 0;
+    int count = 0;
+
+    if (!p_file)
+        return 0;
+
+    while (fgets(line, sizeof(line), p_file))
+    {
+        unsigned long long seq;
+        long long sealed_at;
+        char flag = 0;
+        char path[SEG_PATH_MAX];
+        uint64_t *p_zoffs = NULL;
+        int fd = -1;
+        int zfd = -1;
+
+        if (sscanf(line, "segment_size %lld", &size) == 1)
+            continue;
+        if (sscanf(line, "segment %llu %lld %c", &seq, &sealed_at, &flag) < 2 || size <= 0 ||
+            (count > 0 && seq != atomic_load(&active_seq) + 1) || count == SEG_SLOTS)
+            break;
+
+        if (flag == 'z')
+        {
+            seg_zpath(seq, path);
+            zfd = open(path, O_RDONLY);
+            if (zfd >= 0 && !(p_zoffs = seg_load_zoffs(zfd, size)))
+            {
+                close(zfd);
+                zfd = -1;
+            }
+            if (zfd == -1)
+                break;
+        }
+        else
+        {
+            seg_path(seq, path);
+            fd = open(path, O_RDWR);
+            if (fd == -1)
+                break;
+        }
+        if (count == 0)
+            atomic_store(&first_seq, seq);
+        atomic_store(&active_seq, seq);
+        SEG(seq)->fd = fd;
+        SEG(seq)->zfd = zfd;
+        SEG(seq)->p_zoffs = p_zoffs;
+        SEG(seq)->sealed_at = sealed_at;
+        count++;
+    }
+    fclose(p_file);
+
+    if (count == 0)
+        return 0;
+    if (size != seg_size)
+        syslog(LOG_INFO, "Keeping the existing segment size of %lld bytes", size);
+    seg_size = size;
+
+    // A crash between a rotation and the manifest rewrite leaves segments
+    // only as files; each was started once the one before it was full
+    struct stat st;
+    uint64_t active = atomic_load(&active_seq);
+    while (count < SEG_SLOTS && SEG(active)->fd >= 0 && fstat(SEG(active)->fd, &st) == 0 &&
+           st.st_size == seg_size)
+    {
+        char path[SEG_PATH_MAX];
+        seg_path(active + 1, path);
+        int fd = open(path, O_RDWR);
+        if (fd == -1)
+            break;
+        SEG(active)->sealed_at = time(NULL);
+        active++;
+        SEG(active)->fd = fd;
+        SEG(active)->zfd = -1;
+        SEG(active)->p_zoffs = NULL;
+        atomic_store(&active_seq, active);
+        manifest_dirty = 1;
+        count++;
+    }
+    if (manifest_dirty)
+        syslog(LOG_INFO, "Recovered segments up to %llu past the manifest", (unsigned long long)active);
+
+    if (SEG(active)->fd < 0 || fstat(SEG(active)->fd, &st) != 0)
+        return -1;
+    SEG(active)->sealed_at = 0;
+    write_off = (off_t)active * seg_size + st.st_size;
+    return count;
+}
+
+static int seg_open(const store_config_t *p_config)
+{
+    seg_size = p_config->segment_size;
+    retain_bytes = p_config->retain_bytes;
+    retain_secs = p_config->retain_secs;
+    closing = 0;
+    manifest_dirty = 0;
+    spare_fd = -1;
+    write_off = 0;
+    atomic_store(&first_seq, 0);
+    atomic_store(&active_seq, 0);
+    for (size_t i = 0; i < SEG_SLOTS; i++)
+    {
+        segs[i].fd = -1;
+        segs[i].zfd = -1;
+        segs[i].p_zoffs = NULL;
+    }
+
+    int count = seg_load_manifest();
+    if (count < 0)
+        return -1;
+    if (count == 0)
+    {
+        segs[0].fd = seg_create(0);
+        segs[0].sealed_at = 0;
+        if (segs[0].fd < 0)
+            return -1;
+        // Listed right away, so segments that follow are found after a crash
+        seg_write_manifest();
+    }
+    atomic_store(&committed, write_off);
+    synced_seq = atomic_load(&active_seq);
+
+    // Blocks may not straddle segments, so only whole multiples compress
+    seg_compressing = p_config->compress;
+    compress_seq = atomic_load(&first_seq);
+    if (seg_compressing && seg_size % ZBLOCK_SIZE != 0)
+    {
+        syslog(LOG_WARNING, "Segment size is not a multiple of %d bytes, keeping segments raw", ZBLOCK_SIZE);
+        seg_compressing = 0;
+    }
+
+    if (pthread_create(&maint_tid, NULL, seg_maint_thread, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to create segment maintenance thread");
+        return -1;
+    }
+    syslog(LOG_INFO, "Segmented store: %d segment(s) of %lld bytes", count ? count : 1,
+           (long long)seg_size);
+    return 0;
+}
+
+static void seg_close(void)
+{
+    pthread_mutex_lock(&maint_mutex);
+    closing = 1;
+    pthread_cond_signal(&maint_cond);
+    pthread_mutex_unlock(&maint_mutex);
+    pthread_join(maint_tid, NULL);
+
+    seg_write_manifest();
+    if (spare_fd >= 0)
+    {
+        // An unused spare is not listed in the manifest
+        char path[SEG_PATH_MAX];
+        seg_path(spare_seq, path);
+        close(spare_fd);
+        if (spare_seq > atomic_load(&active_seq))
+            unlink(path);
+        spare_fd = -1;
+    }
+    for (uint64_t seq = atomic_load(&first_seq); seq <= atomic_load(&active_seq); seq++)
+    {
+        if (SEG(seq)->fd >= 0)
+            close(SEG(seq)->fd);
+        if (SEG(seq)->zfd >= 0)
+            close(SEG(seq)->zfd);
+        free(SEG(seq)->p_zoffs);
+        SEG(seq)->fd = -1;
+        SEG(seq)->zfd = -1;
+        SEG(seq)->p_zoffs = NULL;
+    }
+}
+
+// After close: delete every segment the manifest listed, and the manifest
+static void seg_remove(void)
+{
+    char path[SEG_PATH_MAX];
+
+    for (uint64_t seq = atomic_load(&first_seq); seq <= atomic_load(&active_seq); seq++)
+    {
+        seg_path(seq, path);
+        unlink(path);
+        seg_zpath(seq, path);
+        unlink(path);
+    }
+    unlink(MANIFEST_FILE_PATH);
+}
+
+// Seal the active segment and continue in the next one
+static int seg_rotate(void)
+{
+    uint64_t active = atomic_load(&active_seq);
+    int fd = -1;
+
+    if (active + 1 - atomic_load(&first_seq) >= SEG_SLOTS)
+    {
+        syslog(LOG_ERR, "Too many segments retained, tighten the retention policy");
+        return -1;
+    }
+
+    pthread_mutex_lock(&maint_mutex);
+    if (spare_fd >= 0 && spare_seq == active + 1)
+    {
+        fd = spare_fd;
+        spare_fd = -1;
+    }
+    pthread_mutex_unlock(&maint_mutex);
+
+    // The maintenance thread fell behind: pay for the creation here
+    if (fd < 0 && (fd = seg_create(active + 1)) < 0)
+        return -1;
+
+    pthread_rwlock_wrlock(&seg_lock);
+    SEG(active)->sealed_at = time(NULL);
+    SEG(active + 1)->fd = fd;
+    SEG(active + 1)->sealed_at = 0;
+    atomic_store(&active_seq, active + 1);
+    pthread_rwlock_unlock(&seg_lock);
+
+    pthread_mutex_lock(&maint_mutex);
+    manifest_dirty = 1;
+    pthread_cond_signal(&maint_cond);
+    pthread_mutex_unlock(&maint_mutex);
+    return 0;
+}
+
+// The whole batch becomes visible at once, so readers never see part of a
+// packet. A batch that fails leaves write_off where it was and its bytes
+// are written over by the next one, in the segment they went to even if
+// it was sealed meanwhile.
+static int seg_appendv(const struct iovec *iov, int iovcnt)
+{
+    off_t off = write_off;
+
+    for (int i = 0; i < iovcnt; i++)
+    {
+        const char *src = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+
+        while (len > 0)
+        {
+            uint64_t seq = off / seg_size;
+            off_t seg_off = off % seg_size;
+            if (seq > atomic_load(&active_seq) && seg_rotate() != 0)
+                return -1;
+
+            size_t chunk = seg_size - seg_off;
+            if (chunk > len)
+                chunk = len;
+            ssize_t n = pwrite(SEG(seq)->fd, src, chunk, seg_off);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                syslog(LOG_ERR, "Failed to write segment");
+                return -1;
+            }
+            off += n;
+            src += n;
+            len -= n;
+        }
+    }
+    write_off = off;
+    atomic_store_explicit(&committed, write_off, memory_order_release);
+    return 0;
+}
+
+// Resolve off to a segment under seg_lock; returns how many bytes of
+// [off, off + len) that segment holds, 0 at the end and -1 if retention
+// already dropped off
+static ssize_t seg_locate(off_t off, size_t len, segment_t **pp_seg, off_t *p_seg_off)
+{
+    off_t end = atomic_load_explicit(&committed, memory_order_acquire);
+    if (off >= end)
+        return 0;
+    if (off < (off_t)atomic_load(&first_seq) * seg_size)
+    {
+        errno = ERANGE;
+        return -1;
+    }
+
+    *pp_seg = SEG(off / seg_size);
+    *p_seg_off = off % seg_size;
+    if ((off_t)len > end - off)
+        len = end - off;
+    if ((off_t)len > seg_size - *p_seg_off)
+        len = seg_size - *p_seg_off;
+    return len;
+}
+
+// Each thread keeps the block it expanded last, so a reply reading a
+// compressed segment in small pieces expands every block once
+static _Thread_local struct
+{
+    int valid;
+    uint64_t seq;
+    size_t block;
+    char data[ZBLOCK_SIZE];
+} expanded;
+
+// Read from a compressed segment, at most up to the end of one block
+static ssize_t seg_read_compressed(const segment_t *p_seg, uint64_t seq, off_t seg_off, void *buf, size_t len)
+{
+    size_t block = seg_off / ZBLOCK_SIZE;
+    size_t in_block = seg_off % ZBLOCK_SIZE;
+
+    if (!expanded.valid || expanded.seq != seq || expanded.block != block)
+    {
+        size_t z_len = p_seg->p_zoffs[block + 1] - p_seg->p_zoffs[block];
+        size_t raw_len = ZBLOCK_SIZE;
+        void *z = malloc(z_len);
+
+        expanded.valid = 0;
+        if (!z || seg_pread_all(p_seg->zfd, z, z_len, p_seg->p_zoffs[block]) != 0 ||
+            zblock_uncompress(z, z_len, expanded.data, &raw_len) != 0 || raw_len != ZBLOCK_SIZE)
+        {
+            free(z);
+            syslog(LOG_ERR, "Failed to expand block %zu of segment %llu", block, (unsigned long long)seq);
+            errno = EIO;
+            return -1;
+        }
+        free(z);
+        expanded.valid = 1;
+        expanded.seq = seq;
+        expanded.block = block;
+    }
+
+    if (len > ZBLOCK_SIZE - in_block)
+        len = ZBLOCK_SIZE - in_block;
+    memcpy(buf, expanded.data + in_block, len);
+    return len;
+}
+
+static ssize_t seg_read(off_t off, void *buf, size_t len)
+{
+    segment_t *p_seg;
+    off_t seg_off;
+
+    pthread_rwlock_rdlock(&seg_lock);
+    ssize_t n = seg_locate(off, len, &p_seg, &seg_off);
+    if (n > 0 && p_seg->zfd >= 0)
+        n = seg_read_compressed(p_seg, off / seg_size, seg_off, buf, n);
+    else if (n > 0)
+    {
+        do
+            n = pread(p_seg->fd, buf, n, seg_off);
+        while (n < 0 && errno == EINTR);
+    }
+    pthread_rwlock_unlock(&seg_lock);
+    return n;
+}
+
+// Replies go from one segment per call with sendfile(); compressed
+// segments have to be expanded on the way
+static ssize_t seg_send(int sock_fd, off_t off, size_t len, reply_mode_t mode)
+{
+    (void)mode;
+    segment_t *p_seg;
+    off_t seg_off;
+
+    pthread_rwlock_rdlock(&seg_lock);
+    ssize_t n = seg_locate(off, len, &p_seg, &seg_off);
+    if (n > 0 && p_seg->zfd >= 0)
+    {
+        errno = EOPNOTSUPP;
+        n = -1;
+    }
+    else if (n > 0)
+        n = sendfile(sock_fd, p_seg->fd, &seg_off, n);
+    pthread_rwlock_unlock(&seg_lock);
+    return n;
+}
+
+static ssize_t seg_read_block(uint64_t index, void *buf, size_t cap)
+{
+    off_t off = (off_t)index * ZBLOCK_SIZE;
+    ssize_t n = -1;
+
+    pthread_rwlock_rdlock(&seg_lock);
+    if (off >= (off_t)atomic_load(&first_seq) * seg_size && off < atomic_load(&committed))
+    {
+        const segment_t *p_seg = SEG(off / seg_size);
+        size_t block = (off % seg_size) / ZBLOCK_SIZE;
+        if (p_seg->zfd >= 0)
+        {
+            size_t z_len = p_seg->p_zoffs[block + 1] - p_seg->p_zoffs[block];
+            if (z_len <= cap && seg_pread_all(p_seg->zfd, buf, z_len, p_seg->p_zoffs[block]) == 0)
+                n = z_len;
+        }
+    }
+    pthread_rwlock_unlock(&seg_lock);
+    return n;
+}
+
+static off_t seg_size_committed(void)
+{
+    return atomic_load_explicit(&committed, memory_order_acquire);
+}
+
+static off_t seg_start(void)
+{
+    return (off_t)atomic_load(&first_seq) * seg_size;
+}
+
+static int seg_sync(void)
+{
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&seg_lock);
+    uint64_t active = atomic_load(&active_seq);
+    if (synced_seq < atomic_load(&first_seq))
+        synced_seq = atomic_load(&first_seq);
+    for (uint64_t seq = synced_seq; seq <= active; seq++)
+    {
+        // Compressed segments were synced when they were written
+        if (SEG(seq)->fd >= 0 && fdatasync(SEG(seq)->fd) != 0)
+        {
+            syslog(LOG_ERR, "Failed to sync segment");
+            ret = -1;
+        }
+    }
+    synced_seq = active;
+    pthread_rwlock_unlock(&seg_lock);
+    return ret;
+}
+
+const store_ops_t store_seg_ops = {
+    .name = "seg",
+    .keepable = 1,
+    .open = seg_open,
+    .close = seg_close,
+    .remove = seg_remove,
+    .appendv = seg_appendv,
+    .read = seg_read,
+    .send = seg_send,
+    .read_block = seg_read_block,
+    .size = seg_size_committed,
+    .start = seg_start,
+    .sync = seg_sync,
+};
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Stress the commit ring: concurrent persistent connections send numbered
+# packets, then aesdload reads the store back and fails on any packet that
+# is missing, torn or out of its connection's order.
+#
+# Usage: stress-commit.sh [seconds]   (run from server/ after make)
+
+AESDSOCKET=${AESDSOCKET:-./aesdsocket}
+AESDLOAD=${AESDLOAD:-./aesdload}
+DURATION=${1:-5}
+DATA=/var/tmp/aesdsocketdata
+
+status=0
+for opts in "-s file" "-s mem" "-s file -D batch" "-s file -w 0"; do
+    rm -f "$DATA" "$DATA".*
+    $AESDSOCKET $opts &
+    pid=$!
+    sleep 0.5
+
+    echo "== aesdsocket $opts"
+    if ! $AESDLOAD -v -c 32 -t 4 -d "$DURATION"; then
+        echo "FAILED: aesdsocket $opts"
+        status=1
+    fi
+
+    kill "$pid"
+    wait "$pid"
+done
+
+exit $status
@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/timerfd.h>
+#include "timer.h"
+
+// Four levels of 64 slots cover 64^4 ticks, a bit over 19 days. A timer
+// sits in the level whose slot width fits its remaining delay and moves
+// down a level each time the tick reaches its slot there, so every timer
+// is touched at most once per level whatever the number of timers.
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_MASK ((uint64_t)WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+LIST_HEAD(timer_list, tw_timer_s);
+
+static struct timer_list wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+static _Atomic uint64_t wheel_now; // the tick being run or next to run
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wheel_cond = PTHREAD_COND_INITIALIZER;
+static tw_timer_t *p_running; // callback in progress, if any
+
+static int timer_fd = -1;
+static pthread_t timer_tid;
+static _Atomic int timer_closing;
+
+static void wheel_insert(tw_timer_t *p_timer)
+{
+    uint64_t now = atomic_load_explicit(&wheel_now, memory_order_relaxed);
+
+    if (p_timer->expires < now)
+        p_timer->expires = now;
+    if (p_timer->expires - now >= WHEEL_SPAN)
+        p_timer->expires = now + WHEEL_SPAN - 1;
+
+    uint64_t delta = p_timer->expires - now;
+    int level = 0;
+    while (delta >= (uint64_t)1 << (WHEEL_BITS * (level + 1)))
+        level++;
+
+    size_t slot = (p_timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    LIST_INSERT_HEAD(&wheel[level][slot], p_timer, entries);
+    p_timer->armed = 1;
+}
+
+static void wheel_remove(tw_timer_t *p_timer)
+{
+    LIST_REMOVE(p_timer, entries);
+    p_timer->armed = 0;
+}
+
+static uint64_t timer_ticks(unsigned ms)
+{
+    uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    return ticks > 0 ? ticks : 1;
+}
+
+// Called with wheel_mutex held; drops it around each callback
+static void wheel_tick(void)
+{
+    uint64_t now = atomic_load_explicit(&wheel_now, memory_order_relaxed);
+
+    // Slots of the upper levels whose turn has come move down
+    for (int level = 1; level < WHEEL_LEVELS; level++)
+    {
+        if (now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1))
+            break;
+
+        struct timer_list *p_slot = &wheel[level][(now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+        tw_timer_t *p_timer;
+        while ((p_timer = LIST_FIRST(p_slot)) != NULL)
+        {
+            wheel_remove(p_timer);
+            wheel_insert(p_timer);
+        }
+    }
+
+    // Arming always lands at least one tick ahead, so this slot only drains
+    struct timer_list *p_slot = &wheel[0][now & WHEEL_MASK];
+    tw_timer_t *p_timer;
+    while ((p_timer = LIST_FIRST(p_slot)) != NULL)
+    {
+        wheel_remove(p_timer);
+        p_running = p_timer;
+        pthread_mutex_unlock(&wheel_mutex);
+
+        unsigned ms = p_timer->fn(p_timer->p_arg);
+
+        pthread_mutex_lock(&wheel_mutex);
+        if (ms > 0 && !p_timer->armed)
+        {
+            p_timer->expires = now + timer_ticks(ms);
+            wheel_insert(p_timer);
+        }
+        p_running = NULL;
+        pthread_cond_broadcast(&wheel_cond);
+    }
+
+    atomic_store_explicit(&wheel_now, now + 1, memory_order_relaxed);
+}
+
+static void *timer_thread(void *arg)
+{
+    (void)arg;
+    uint64_t expirations;
+
+    while (!atomic_load(&timer_closing))
+    {
+        if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+        {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Failed to read timer");
+            break;
+        }
+
+        // A late wakeup catches up on every tick it missed
+        pthread_mutex_lock(&wheel_mutex);
+        while (expirations-- > 0)
+            wheel_tick();
+        pthread_mutex_unlock(&wheel_mutex);
+    }
+    return NULL;
+}
+
+int timer_start(void)
+{
+    struct itimerspec period = {
+        .it_interval = {.tv_nsec = TIMER_TICK_MS * 1000000L},
+        .it_value = {.tv_nsec = TIMER_TICK_MS * 1000000L},
+    };
+
+    for (int level = 0; level < WHEEL_LEVELS; level++)
+        for (int slot = 0; slot < WHEEL_SLOTS; slot++)
+            LIST_INIT(&wheel[level][slot]);
+    atomic_store(&wheel_now, 0);
+    atomic_store(&timer_closing, 0);
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    if (timer_fd == -1 || timerfd_settime(timer_fd, 0, &period, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to create timerfd");
+        if (timer_fd >= 0)
+            close(timer_fd);
+        timer_fd = -1;
+        return -1;
+    }
+
+    if (pthread_create(&timer_tid, NULL, timer_thread, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Failed to create timer thread");
+        close(timer_fd);
+        timer_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+// Timers still armed are simply never run again
+void timer_stop(void)
+{
+    if (timer_fd < 0)
+        return;
+
+    // The thread sees the flag by the next tick at the latest
+    atomic_store(&timer_closing, 1);
+    pthread_join(timer_tid, NULL);
+    close(timer_fd);
+    timer_fd = -1;
+}
+
+void timer_init(tw_timer_t *p_timer, timer_fn_t fn, void *p_arg)
+{
+    p_timer->expires = 0;
+    p_timer->armed = 0;
+    p_timer->fn = fn;
+    p_timer->p_arg = p_arg;
+}
+
+void timer_arm(tw_timer_t *p_timer, unsigned ms)
+{
+    pthread_mutex_lock(&wheel_mutex);
+    if (p_timer->armed)
+        wheel_remove(p_timer);
+    p_timer->expires = atomic_load_explicit(&wheel_now, memory_order_relaxed) + timer_ticks(ms);
+    wheel_insert(p_timer);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+void timer_cancel(tw_timer_t *p_timer)
+{
+    pthread_mutex_lock(&wheel_mutex);
+    while (p_running == p_timer)
+        pthread_cond_wait(&wheel_cond, &wheel_mutex);
+    if (p_timer->armed)
+        wheel_remove(p_timer);
+    pthread_mutex_unlock(&wheel_mutex);
+}
+
+uint64_t timer_now(void)
+{
+    return atomic_load_explicit(&wheel_now, memory_order_relaxed);
+}
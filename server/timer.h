@@ -0,0 +1,41 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include "queue.h"
+
+// Hierarchical timer wheel driven by one timerfd thread. Arming and
+// cancelling are O(1) under a single mutex, so a timer per connection is
+// cheap. Expiry is accurate to one tick.
+#define TIMER_TICK_MS 100
+
+// Runs on the timer thread without the wheel lock held. Returns the delay
+// in milliseconds after which to run again, or 0 to stay disarmed.
+typedef unsigned (*timer_fn_t)(void *p_arg);
+
+typedef struct tw_timer_s tw_timer_t;
+struct tw_timer_s
+{
+    uint64_t expires; // tick
+    int armed;
+    timer_fn_t fn;
+    void *p_arg;
+    LIST_ENTRY(tw_timer_s) entries;
+};
+
+int timer_start(void);
+void timer_stop(void);
+
+void timer_init(tw_timer_t *p_timer, timer_fn_t fn, void *p_arg);
+
+// (Re)arm to fire after ms milliseconds, at least one tick from now
+void timer_arm(tw_timer_t *p_timer, unsigned ms);
+
+// Disarm and wait for a running callback to return, after which the timer
+// may be freed. Must not be called from the timer's own callback.
+void timer_cancel(tw_timer_t *p_timer);
+
+// Ticks since timer_start(), a cheap coarse monotonic clock
+uint64_t timer_now(void);
+
+#endif /* TIMER_H */
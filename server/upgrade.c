@@ -0,0 +1,270 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "upgrade.h"
+#include "stats.h"
+
+// The handover socket is passed to the new instance as this descriptor
+#define UPGRADE_ENV "AESD_UPGRADE_FD"
+#define UPGRADE_FD 3
+#define UPGRADE_READY_MS 5000
+#define UPGRADE_ADOPT_MAX 1024
+
+// One message per descriptor over a SOCK_SEQPACKET pair, in this order:
+// LISTENER... END from the old instance, READY back, then CONN... RELEASE
+typedef enum
+{
+    UPGRADE_LISTENER,
+    UPGRADE_END,
+    UPGRADE_READY,
+    UPGRADE_CONN,
+    UPGRADE_RELEASE,
+} upgrade_type_t;
+
+typedef struct
+{
+    upgrade_type_t type;
+    char ipstr[INET6_ADDRSTRLEN];
+} upgrade_msg_t;
+
+static char self_path[PATH_MAX];
+static char **self_argv;
+static int peer_fd = -1; // to the other instance while a handover runs
+static conn_task_t adopted[UPGRADE_ADOPT_MAX];
+static int adopted_count;
+
+static int upgrade_send(upgrade_type_t type, int fd, const char *ipstr)
+{
+    upgrade_msg_t msg = {.type = type};
+    struct iovec iov = {.iov_base = &msg, .iov_len = sizeof(msg)};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+
+    if (ipstr)
+        strncpy(msg.ipstr, ipstr, sizeof(msg.ipstr) - 1);
+    if (fd >= 0)
+    {
+        mh.msg_control = ctrl.buf;
+        mh.msg_controllen = sizeof(ctrl.buf);
+        struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&mh);
+        p_cmsg->cmsg_level = SOL_SOCKET;
+        p_cmsg->cmsg_type = SCM_RIGHTS;
+        p_cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(p_cmsg), &fd, sizeof(int));
+    }
+    return sendmsg(peer_fd, &mh, MSG_NOSIGNAL) == sizeof(msg) ? 0 : -1;
+}
+
+// Next message and the descriptor it carries, or -1 in *p_fd if none.
+// Fails at end of file.
+static int upgrade_recv(upgrade_msg_t *p_msg, int *p_fd)
+{
+    struct iovec iov = {.iov_base = p_msg, .iov_len = sizeof(*p_msg)};
+    struct msghdr mh = {.msg_iov = &iov, .msg_iovlen = 1};
+    union
+    {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctrl;
+
+    mh.msg_control = ctrl.buf;
+    mh.msg_controllen = sizeof(ctrl.buf);
+    *p_fd = -1;
+
+    ssize_t n;
+    do
+        n = recvmsg(peer_fd, &mh, MSG_CMSG_CLOEXEC);
+    while (n < 0 && errno == EINTR);
+
+    struct cmsghdr *p_cmsg = CMSG_FIRSTHDR(&mh);
+    if (p_cmsg && p_cmsg->cmsg_level == SOL_SOCKET && p_cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(p_fd, CMSG_DATA(p_cmsg), sizeof(int));
+    if (n != sizeof(*p_msg))
+    {
+        if (*p_fd >= 0)
+            close(*p_fd);
+        return -1;
+    }
+    p_msg->ipstr[sizeof(p_msg->ipstr) - 1] = '\0';
+    return 0;
+}
+
+int upgrade_init(char *argv[])
+{
+    // Resolved now: once a deploy replaces the file, this process's link
+    // points at the deleted old binary
+    ssize_t n = readlink("/proc/self/exe", self_path, sizeof(self_path) - 1);
+    if (n < 0)
+        return -1;
+    self_path[n] = '\0';
+    self_argv = argv;
+    return 0;
+}
+
+int upgrade_spawn(const int *p_fds, int n)
+{
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) != 0)
+    {
+        syslog(LOG_ERR, "Failed to create upgrade socket");
+        return -1;
+    }
+
+    // Prepared before the fork, which leaves only async-signal-safe calls
+    setenv(UPGRADE_ENV, "3", 1);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        // Only the handover socket crosses the exec, with every signal open
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        if (sv[1] == UPGRADE_FD)
+            fcntl(sv[1], F_SETFD, 0);
+        else if (dup2(sv[1], UPGRADE_FD) != UPGRADE_FD)
+            _exit(127);
+        close_range(UPGRADE_FD + 1, ~0U, 0);
+        execv(self_path, self_argv);
+        _exit(127);
+    }
+    unsetenv(UPGRADE_ENV);
+    close(sv[1]);
+    if (pid < 0)
+    {
+        syslog(LOG_ERR, "fork() failed for upgrade");
+        close(sv[0]);
+        return -1;
+    }
+    peer_fd = sv[0];
+
+    int ok = 1;
+    for (int i = 0; i < n && ok; i++)
+        ok = upgrade_send(UPGRADE_LISTENER, p_fds[i], NULL) == 0;
+    ok = ok && upgrade_send(UPGRADE_END, -1, NULL) == 0;
+
+    // The new instance owns the sockets only once it says so
+    struct pollfd pfd = {.fd = peer_fd, .events = POLLIN};
+    upgrade_msg_t msg;
+    int fd;
+    if (ok && poll(&pfd, 1, UPGRADE_READY_MS) == 1 && upgrade_recv(&msg, &fd) == 0 && msg.type == UPGRADE_READY)
+    {
+        syslog(LOG_INFO, "Handed %d listening socket(s) to %s, pid %d", n, self_path, (int)pid);
+        return 0;
+    }
+
+    syslog(LOG_ERR, "New instance did not take over, keeping this one");
+    close(peer_fd);
+    peer_fd = -1;
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+void upgrade_hand_off(const conn_task_t *p_task)
+{
+    if (upgrade_send(UPGRADE_CONN, p_task->client_fd, p_task->ipstr) != 0)
+        syslog(LOG_ERR, "Failed to hand over connection from %s", p_task->ipstr);
+    close(p_task->client_fd);
+}
+
+void upgrade_release(void)
+{
+    upgrade_send(UPGRADE_RELEASE, -1, NULL);
+    close(peer_fd);
+    peer_fd = -1;
+}
+
+int upgrade_inherit(int *p_fds, int max)
+{
+    const char *env = getenv(UPGRADE_ENV);
+    upgrade_msg_t msg;
+    int fd;
+    int n = 0;
+    int ended = 0;
+
+    if (!env)
+        return 0;
+    peer_fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    fcntl(peer_fd, F_SETFD, FD_CLOEXEC);
+
+    while (!ended && upgrade_recv(&msg, &fd) == 0)
+    {
+        ended = msg.type == UPGRADE_END;
+        if (fd < 0)
+            continue;
+        if (n == max)
+        {
+            close(fd);
+            continue;
+        }
+        // The event loop left it non-blocking, for the whole open file
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+        p_fds[n++] = fd;
+    }
+    if (!ended || upgrade_send(UPGRADE_READY, -1, NULL) != 0)
+    {
+        syslog(LOG_ERR, "Upgrade handover failed");
+        for (int i = 0; i < n; i++)
+            close(p_fds[i]);
+        close(peer_fd);
+        peer_fd = -1;
+        return -1;
+    }
+    syslog(LOG_INFO, "Took over %d listening socket(s)", n);
+    return n;
+}
+
+void upgrade_wait(void)
+{
+    upgrade_msg_t msg;
+    int fd;
+
+    if (peer_fd < 0)
+        return;
+
+    // Running out of messages without a release means the old instance is
+    // gone, and the store with it
+    while (upgrade_recv(&msg, &fd) == 0 && msg.type != UPGRADE_RELEASE)
+    {
+        if (fd < 0)
+            continue;
+        if (msg.type != UPGRADE_CONN || adopted_count == UPGRADE_ADOPT_MAX)
+        {
+            close(fd);
+            continue;
+        }
+        conn_task_t *p_task = &adopted[adopted_count++];
+        p_task->client_fd = fd;
+        memcpy(p_task->ipstr, msg.ipstr, sizeof(p_task->ipstr));
+    }
+    close(peer_fd);
+    peer_fd = -1;
+    syslog(LOG_INFO, "Old instance released the store, %d connection(s) handed over", adopted_count);
+}
+
+void upgrade_adopt(int (*submit)(const conn_task_t *p_task))
+{
+    for (int i = 0; i < adopted_count; i++)
+    {
+        adopted[i].accepted_ns = stats_now();
+        if (!submit || submit(&adopted[i]) != 0)
+            close(adopted[i].client_fd);
+    }
+    adopted_count = 0;
+}
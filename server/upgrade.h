@@ -0,0 +1,48 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include "worker_pool.h"
+
+// Hot upgrade: on SIGUSR2 the running instance execs its binary again and
+// hands the new instance its listening sockets over a Unix socket with
+// SCM_RIGHTS. The sockets never close, so clients arriving meanwhile wait
+// in the accept queue instead of being refused. The old instance then
+// drains its clients, passes on connections it accepted but never served,
+// closes the store and only then lets the new one open it.
+
+// Remember how to exec this binary; call before anything changes directory
+int upgrade_init(char *argv[]);
+
+/* ---------------------------
+   Old instance
+   --------------------------- */
+
+// Start the new instance and hand it the n listening sockets in p_fds.
+// Returns 0 once it has taken them, or -1 with this instance still in
+// charge of them.
+int upgrade_spawn(const int *p_fds, int n);
+
+// Pass an accepted connection on to the new instance; closes our copy
+void upgrade_hand_off(const conn_task_t *p_task);
+
+// The store is closed: let the new instance open it
+void upgrade_release(void);
+
+/* ---------------------------
+   New instance
+   --------------------------- */
+
+// Take over listening sockets from the instance that started us, up to max
+// of them into p_fds. Returns how many, 0 when this is a normal start and
+// -1 when the handover failed.
+int upgrade_inherit(int *p_fds, int max);
+
+// Wait until the old instance has released the store, collecting the
+// connections it hands over meanwhile. Returns at once on a normal start.
+void upgrade_wait(void);
+
+// Serve the collected connections through submit, or close them when it
+// is NULL or refuses one
+void upgrade_adopt(int (*submit)(const conn_task_t *p_task));
+
+#endif /* UPGRADE_H */
@@ -0,0 +1,776 @@
+#define _GNU_SOURCE
+
+#include <syslog.h>
+#include "uring.h"
+
+#ifndef AESD_IO_URING
+
+int uring_run(int listen_fd)
+{
+    (void)listen_fd;
+    syslog(LOG_WARNING, "Built without io_uring support");
+    return URING_UNSUPPORTED;
+}
+
+#else
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "conn.h"
+#include "store.h"
+#include "stats.h"
+#include "log_ring.h"
+#include "timer.h"
+
+// Single-threaded completion loop. The listening socket is accepted with
+// one multishot SQE, client data arrives in buffers the kernel picks from a
+// provided-buffer ring, and replies are read from the data file into
+// registered buffers with each READ linked to the SEND that drains it.
+// All SQEs queued while a batch of completions is handled go to the kernel
+// in a single io_uring_enter().
+#define UR_ENTRIES 256
+#define UR_MAX_CONNS 1024
+#define UR_PBUF_COUNT 256 // must be a power of two
+#define UR_PBUF_GROUP 0
+#define UR_REPLY_BUF_SIZE (8 * 1024)
+
+// Registered file slots
+#define UR_FILE_LISTEN 0
+#define UR_FILE_DATA 1
+
+enum
+{
+    UR_OP_ACCEPT,
+    UR_OP_RECV,
+    UR_OP_READ,
+    UR_OP_SEND,
+    UR_OP_CANCEL,
+    UR_OP_TIMEOUT,
+};
+
+#define UR_USER_DATA(slot, op) (((uint64_t)(slot) << 8) | (op))
+
+typedef struct
+{
+    int ring_fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_size;
+    void *sqes_ptr;
+    size_t sqes_size;
+} uring_t;
+
+typedef struct
+{
+    conn_t conn;
+    int in_use;
+    int done;
+    int pending;
+    off_t reply_end;
+    size_t send_len;
+    size_t send_done;
+    int sending_header;
+    char *reply_buf;
+    const char *send_buf; // reply_buf, or snapshot memory sent in place
+    uint64_t accepted_ns; // stats_now() at the accept completion, 0 once first received
+} ur_conn_t;
+
+static uring_t ring = {.ring_fd = -1};
+static ur_conn_t *conns;
+static int free_slots[UR_MAX_CONNS];
+static int free_count;
+static char *reply_bufs;
+static int reply_bufs_registered;
+static int data_fixed;
+static struct io_uring_buf_ring *pbuf_ring;
+static size_t pbuf_ring_size;
+static char *pbufs;
+static unsigned short pbuf_tail;
+static int accepted_any;
+static int draining;
+static struct __kernel_timespec drain_tick = {.tv_nsec = TIMER_TICK_MS * 1000000L};
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p_params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p_params);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static int ur_ring_init(void)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring.ring_fd = sys_io_uring_setup(UR_ENTRIES, &params);
+    if (ring.ring_fd < 0)
+        return -1;
+
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_NODROP))
+    {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring.ring_size = sq_size > cq_size ? sq_size : cq_size;
+    ring.ring_ptr = mmap(NULL, ring.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring.ring_fd, IORING_OFF_SQ_RING);
+    if (ring.ring_ptr == MAP_FAILED)
+    {
+        ring.ring_ptr = NULL;
+        return -1;
+    }
+
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes_ptr = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring.ring_fd, IORING_OFF_SQES);
+    if (ring.sqes_ptr == MAP_FAILED)
+    {
+        ring.sqes_ptr = NULL;
+        return -1;
+    }
+
+    char *p = ring.ring_ptr;
+    ring.sq_head = (unsigned *)(p + params.sq_off.head);
+    ring.sq_tail = (unsigned *)(p + params.sq_off.tail);
+    ring.sq_mask = (unsigned *)(p + params.sq_off.ring_mask);
+    ring.cq_head = (unsigned *)(p + params.cq_off.head);
+    ring.cq_tail = (unsigned *)(p + params.cq_off.tail);
+    ring.cq_mask = (unsigned *)(p + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(p + params.cq_off.cqes);
+    ring.sqes = ring.sqes_ptr;
+    ring.sq_entries = params.sq_entries;
+    ring.sq_local_tail = *ring.sq_tail;
+
+    // SQ slots map one-to-one onto SQEs, so the index array is set once
+    unsigned *sq_array = (unsigned *)(p + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+        sq_array[i] = i;
+
+    return 0;
+}
+
+static int ur_probe_ops(void)
+{
+    static const int needed[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+                                 IORING_OP_READ, IORING_OP_READ_FIXED};
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *p_probe = calloc(1, size);
+    int ret = 0;
+
+    if (!p_probe)
+        return -1;
+
+    if (sys_io_uring_register(ring.ring_fd, IORING_REGISTER_PROBE, p_probe, 256) < 0)
+        ret = -1;
+
+    for (size_t i = 0; ret == 0 && i < sizeof(needed) / sizeof(needed[0]); i++)
+    {
+        if (needed[i] > p_probe->last_op || !(p_probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+            ret = -1;
+    }
+
+    free(p_probe);
+    return ret;
+}
+
+static void ur_pbuf_recycle(unsigned short bid)
+{
+    struct io_uring_buf *p_buf = &pbuf_ring->bufs[pbuf_tail & (UR_PBUF_COUNT - 1)];
+    p_buf->addr = (uintptr_t)(pbufs + (size_t)bid * BUF_SIZE);
+    p_buf->len = BUF_SIZE;
+    p_buf->bid = bid;
+    pbuf_tail++;
+    __atomic_store_n(&pbuf_ring->tail, pbuf_tail, __ATOMIC_RELEASE);
+}
+
+static int ur_pbuf_init(void)
+{
+    long page_size = sysconf(_SC_PAGESIZE);
+    pbuf_ring_size = UR_PBUF_COUNT * sizeof(struct io_uring_buf);
+    pbuf_ring_size = (pbuf_ring_size + page_size - 1) & ~(size_t)(page_size - 1);
+
+    pbuf_ring = mmap(NULL, pbuf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pbuf_ring == MAP_FAILED)
+    {
+        pbuf_ring = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)pbuf_ring;
+    reg.ring_entries = UR_PBUF_COUNT;
+    reg.bgid = UR_PBUF_GROUP;
+    if (sys_io_uring_register(ring.ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    pbufs = malloc((size_t)UR_PBUF_COUNT * BUF_SIZE);
+    if (!pbufs)
+        return -1;
+
+    for (unsigned short bid = 0; bid < UR_PBUF_COUNT; bid++)
+        ur_pbuf_recycle(bid);
+    return 0;
+}
+
+static int ur_register_files(int listen_fd)
+{
+    int files[2] = {listen_fd, store_fd()};
+    unsigned nr_files = files[UR_FILE_DATA] >= 0 ? 2 : 1;
+
+    if (sys_io_uring_register(ring.ring_fd, IORING_REGISTER_FILES, files, nr_files) < 0)
+        return -1;
+    data_fixed = nr_files == 2;
+    return 0;
+}
+
+// Pinned reply buffers are an optimisation: without them READ replaces READ_FIXED
+static void ur_register_buffers(void)
+{
+    struct iovec iov = {.iov_base = reply_bufs, .iov_len = (size_t)UR_MAX_CONNS * UR_REPLY_BUF_SIZE};
+
+    reply_bufs_registered = sys_io_uring_register(ring.ring_fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    if (!reply_bufs_registered)
+        syslog(LOG_WARNING, "io_uring buffer registration failed, using plain reads");
+}
+
+static void ur_teardown(void)
+{
+    if (conns)
+    {
+        for (int i = 0; i < UR_MAX_CONNS; i++)
+        {
+            if (conns[i].in_use)
+                conn_close(&conns[i].conn);
+        }
+    }
+
+    if (ring.ring_fd >= 0)
+        close(ring.ring_fd);
+    if (ring.sqes_ptr)
+        munmap(ring.sqes_ptr, ring.sqes_size);
+    if (ring.ring_ptr)
+        munmap(ring.ring_ptr, ring.ring_size);
+    if (pbuf_ring)
+        munmap(pbuf_ring, pbuf_ring_size);
+
+    free(pbufs);
+    free(reply_bufs);
+    free(conns);
+    memset(&ring, 0, sizeof(ring));
+    ring.ring_fd = -1;
+    pbuf_ring = NULL;
+    pbufs = NULL;
+    reply_bufs = NULL;
+    conns = NULL;
+}
+
+static struct io_uring_sqe *ur_get_sqe(void)
+{
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+    if (ring.sq_local_tail - head >= ring.sq_entries)
+    {
+        // Queue full: hand the batch to the kernel now
+        __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+        sys_io_uring_enter(ring.ring_fd, ring.sq_local_tail - head, 0, 0);
+        head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+        if (ring.sq_local_tail - head >= ring.sq_entries)
+            return NULL;
+    }
+
+    struct io_uring_sqe *p_sqe = &ring.sqes[ring.sq_local_tail & *ring.sq_mask];
+    ring.sq_local_tail++;
+    memset(p_sqe, 0, sizeof(*p_sqe));
+    return p_sqe;
+}
+
+static int ur_arm_tick(void)
+{
+    struct io_uring_sqe *p_sqe = ur_get_sqe();
+    if (!p_sqe)
+        return -1;
+
+    p_sqe->opcode = IORING_OP_TIMEOUT;
+    p_sqe->addr = (uintptr_t)&drain_tick;
+    p_sqe->len = 1;
+    p_sqe->user_data = UR_USER_DATA(0, UR_OP_TIMEOUT);
+    return 0;
+}
+
+static int ur_arm_accept(void)
+{
+    struct io_uring_sqe *p_sqe = ur_get_sqe();
+    if (!p_sqe)
+        return -1;
+
+    p_sqe->opcode = IORING_OP_ACCEPT;
+    p_sqe->flags = IOSQE_FIXED_FILE;
+    p_sqe->fd = UR_FILE_LISTEN;
+    p_sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    p_sqe->accept_flags = SOCK_CLOEXEC;
+    p_sqe->user_data = UR_USER_DATA(0, UR_OP_ACCEPT);
+    return 0;
+}
+
+// Stop accepting, and wake the drain loop every tick from now on
+static int ur_drain_start(void)
+{
+    struct io_uring_sqe *p_sqe = ur_get_sqe();
+    if (!p_sqe)
+        return -1;
+
+    p_sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    p_sqe->addr = UR_USER_DATA(0, UR_OP_ACCEPT);
+    p_sqe->user_data = UR_USER_DATA(0, UR_OP_CANCEL);
+    draining = 1;
+    return ur_arm_tick();
+}
+
+static void ur_conn_finish(int slot)
+{
+    conns[slot].done = 1;
+}
+
+static void ur_arm_recv(int slot)
+{
+    struct io_uring_sqe *p_sqe = ur_get_sqe();
+    if (!p_sqe)
+    {
+        ur_conn_finish(slot);
+        return;
+    }
+
+    p_sqe->opcode = IORING_OP_RECV;
+    p_sqe->flags = IOSQE_BUFFER_SELECT;
+    p_sqe->fd = conns[slot].conn.client_fd;
+    p_sqe->len = BUF_SIZE;
+    p_sqe->buf_group = UR_PBUF_GROUP;
+    p_sqe->user_data = UR_USER_DATA(slot, UR_OP_RECV);
+    conns[slot].pending++;
+}
+
+static struct io_uring_sqe *ur_prep_send(int slot)
+{
+    ur_conn_t *p_uc = &conns[slot];
+    struct io_uring_sqe *p_sqe = ur_get_sqe();
+    if (!p_sqe)
+        return NULL;
+
+    p_sqe->opcode = IORING_OP_SEND;
+    p_sqe->fd = p_uc->conn.client_fd;
+    p_sqe->addr = (uintptr_t)(p_uc->send_buf + p_uc->send_done);
+    p_sqe->len = p_uc->send_len - p_uc->send_done;
+    p_sqe->msg_flags = MSG_NOSIGNAL;
+    p_sqe->user_data = UR_USER_DATA(slot, UR_OP_SEND);
+    p_uc->pending++;
+    return p_sqe;
+}
+
+static void ur_reply_start(int slot);
+
+// The reply went out in full: keep serving a persistent connection
+static void ur_reply_done(int slot)
+{
+    switch (conn_end_reply(&conns[slot].conn))
+    {
+    case 1:
+        ur_reply_start(slot);
+        break;
+    case 0:
+        ur_arm_recv(slot);
+        break;
+    default:
+        ur_conn_finish(slot);
+        break;
+    }
+}
+
+// Queue the next reply chunk, or finish once the reply reached the end
+static void ur_reply_next(int slot)
+{
+    ur_conn_t *p_uc = &conns[slot];
+
+    if (p_uc->conn.reply_off >= p_uc->reply_end)
+    {
+        // Open-ended replies run to the end of the store, including bytes
+        // appended meanwhile
+        if (p_uc->conn.reply_end < 0)
+            p_uc->reply_end = store_size();
+        if (p_uc->conn.reply_off >= p_uc->reply_end)
+        {
+            ur_reply_done(slot);
+            return;
+        }
+    }
+
+    if (p_uc->conn.compress)
+    {
+        // Frames are produced, and the reply advanced, as they are copied
+        ssize_t n = conn_frame_read(&p_uc->conn, p_uc->reply_buf, UR_REPLY_BUF_SIZE);
+        p_uc->send_buf = p_uc->reply_buf;
+        p_uc->send_len = n > 0 ? n : 0;
+        p_uc->send_done = 0;
+        if (n <= 0 || !ur_prep_send(slot))
+            ur_conn_finish(slot);
+        return;
+    }
+
+    size_t len = p_uc->reply_end - p_uc->conn.reply_off;
+    if (p_uc->conn.p_snap)
+    {
+        // The shared snapshot stays referenced until the connection is
+        // released, which waits for this send
+        const char *p_data = snapshot_data(p_uc->conn.p_snap, p_uc->conn.reply_off, &len);
+        if (p_data)
+        {
+            p_uc->send_buf = p_data;
+            p_uc->send_len = len;
+            p_uc->send_done = 0;
+            if (!ur_prep_send(slot))
+                ur_conn_finish(slot);
+            return;
+        }
+    }
+
+    if (len > UR_REPLY_BUF_SIZE)
+        len = UR_REPLY_BUF_SIZE;
+    p_uc->send_buf = p_uc->reply_buf;
+    p_uc->send_len = len;
+    p_uc->send_done = 0;
+
+    if (!data_fixed)
+    {
+        // Stores may return less than asked, e.g. at a segment boundary
+        ssize_t n = store_read(p_uc->conn.reply_off, p_uc->reply_buf, len);
+        if (n > 0)
+            p_uc->send_len = n;
+        if (n <= 0 || !ur_prep_send(slot))
+            ur_conn_finish(slot);
+        return;
+    }
+
+    // READ -> SEND link: a failed or short read cancels the send
+    struct io_uring_sqe *p_read = ur_get_sqe();
+    if (!p_read)
+    {
+        ur_conn_finish(slot);
+        return;
+    }
+    p_read->opcode = reply_bufs_registered ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    p_read->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    p_read->fd = UR_FILE_DATA;
+    p_read->addr = (uintptr_t)p_uc->reply_buf;
+    p_read->len = len;
+    p_read->off = p_uc->conn.reply_off;
+    p_read->buf_index = 0;
+    p_read->user_data = UR_USER_DATA(slot, UR_OP_READ);
+    p_uc->pending++;
+
+    if (!ur_prep_send(slot))
+    {
+        // The READ is already queued with a dangling link; let it complete
+        ur_conn_finish(slot);
+    }
+}
+
+static void ur_reply_start(int slot)
+{
+    ur_conn_t *p_uc = &conns[slot];
+
+    conn_begin_reply(&p_uc->conn);
+    p_uc->reply_end = p_uc->conn.reply_end >= 0 ? p_uc->conn.reply_end : 0;
+    if (p_uc->conn.buf_len == 0)
+    {
+        ur_reply_next(slot);
+        return;
+    }
+
+    memcpy(p_uc->reply_buf, p_uc->conn.buffer, p_uc->conn.buf_len);
+    p_uc->send_buf = p_uc->reply_buf;
+    p_uc->send_len = p_uc->conn.buf_len;
+    p_uc->send_done = 0;
+    p_uc->sending_header = 1;
+    if (!ur_prep_send(slot))
+        ur_conn_finish(slot);
+}
+
+static void ur_conn_release(int slot)
+{
+    conn_close(&conns[slot].conn);
+    conns[slot].in_use = 0;
+    free_slots[free_count++] = slot;
+}
+
+static void ur_conn_open(int client_fd)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_len = sizeof(client_addr);
+    char ipstr[INET6_ADDRSTRLEN];
+
+    if (free_count == 0)
+    {
+        log_conn(LOG_ERR, "io_uring connection table full, dropping connection");
+        close(client_fd);
+        return;
+    }
+
+    if (getpeername(client_fd, (struct sockaddr *)&client_addr, &client_addr_len) != 0 ||
+        get_client_ip(client_addr, ipstr, INET6_ADDRSTRLEN) != 0)
+    {
+        close(client_fd);
+        return;
+    }
+
+    log_conn(LOG_INFO, "Accepted connection from %s", ipstr);
+
+    int slot = free_slots[--free_count];
+    ur_conn_t *p_uc = &conns[slot];
+    conn_init(&p_uc->conn, client_fd, ipstr);
+    p_uc->in_use = 1;
+    p_uc->done = 0;
+    p_uc->pending = 0;
+    p_uc->reply_end = 0;
+    p_uc->sending_header = 0;
+    p_uc->accepted_ns = stats_now();
+    ur_arm_recv(slot);
+    if (p_uc->pending == 0)
+        ur_conn_release(slot);
+}
+
+static void ur_handle_recv(int slot, const struct io_uring_cqe *p_cqe)
+{
+    ur_conn_t *p_uc = &conns[slot];
+    int res = p_cqe->res;
+    int has_buf = p_cqe->flags & IORING_CQE_F_BUFFER;
+    unsigned short bid = p_cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+    if (p_uc->accepted_ns)
+    {
+        stats_record(STAT_PHASE_ACCEPT, stats_now() - p_uc->accepted_ns);
+        p_uc->accepted_ns = 0;
+    }
+
+    if (res > 0 && has_buf)
+    {
+        int ret = conn_ingest(&p_uc->conn, pbufs + (size_t)bid * BUF_SIZE, res);
+        ur_pbuf_recycle(bid);
+        if (ret < 0)
+            ur_conn_finish(slot);
+        else if (ret == 1)
+            ur_reply_start(slot);
+        else
+            ur_arm_recv(slot);
+        return;
+    }
+
+    if (has_buf)
+        ur_pbuf_recycle(bid);
+
+    if (res == 0 && conn_peer_closed(&p_uc->conn) > 0)
+        ur_reply_start(slot); // peer shut down its side: reply anyway
+    else if (res == -ENOBUFS)
+        ur_arm_recv(slot); // every buffer is in flight; they return this batch
+    else
+        ur_conn_finish(slot);
+}
+
+static void ur_handle_send(int slot, int res)
+{
+    ur_conn_t *p_uc = &conns[slot];
+
+    if (res < 0)
+    {
+        stats_add(STAT_ERRORS, 1);
+        ur_conn_finish(slot);
+        return;
+    }
+
+    p_uc->send_done += res;
+    conn_sent(&p_uc->conn, res);
+    if (p_uc->send_done < p_uc->send_len)
+    {
+        if (!ur_prep_send(slot))
+            ur_conn_finish(slot);
+        return;
+    }
+
+    if (p_uc->sending_header)
+        p_uc->sending_header = 0;
+    else if (!p_uc->conn.compress)
+        p_uc->conn.reply_off += p_uc->send_len;
+    ur_reply_next(slot);
+}
+
+static int ur_handle_cqe(const struct io_uring_cqe *p_cqe)
+{
+    int op = p_cqe->user_data & 0xff;
+    int slot = (int)(p_cqe->user_data >> 8);
+
+    if (op == UR_OP_ACCEPT)
+    {
+        if (p_cqe->res >= 0)
+        {
+            accepted_any = 1;
+            ur_conn_open(p_cqe->res);
+        }
+        else if (draining)
+            return 0; // cancelled, the listening socket stays as it is
+        else if (p_cqe->res == -EINVAL && !accepted_any)
+            return URING_UNSUPPORTED; // no multishot accept on this kernel
+        else
+            log_conn(LOG_ERR, "io_uring accept failed: %s", strerror(-p_cqe->res));
+
+        if (!(p_cqe->flags & IORING_CQE_F_MORE) && !draining && ur_arm_accept() != 0)
+            return -1;
+        return 0;
+    }
+    if (op == UR_OP_CANCEL)
+        return 0;
+    if (op == UR_OP_TIMEOUT)
+        return ur_arm_tick();
+
+    conns[slot].pending--;
+    switch (op)
+    {
+    case UR_OP_RECV:
+        ur_handle_recv(slot, p_cqe);
+        break;
+    case UR_OP_READ:
+        // Errors and short reads surface as a cancelled SEND
+        break;
+    case UR_OP_SEND:
+        ur_handle_send(slot, p_cqe->res);
+        break;
+    }
+
+    if (conns[slot].done && conns[slot].pending == 0)
+        ur_conn_release(slot);
+    return 0;
+}
+
+static int ur_setup(int listen_fd)
+{
+    if (ur_ring_init() != 0 || ur_probe_ops() != 0 || ur_pbuf_init() != 0 ||
+        ur_register_files(listen_fd) != 0)
+        return URING_UNSUPPORTED;
+
+    conns = calloc(UR_MAX_CONNS, sizeof(ur_conn_t));
+    reply_bufs = aligned_alloc(sysconf(_SC_PAGESIZE), (size_t)UR_MAX_CONNS * UR_REPLY_BUF_SIZE);
+    if (!conns || !reply_bufs)
+    {
+        syslog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+
+    for (int i = 0; i < UR_MAX_CONNS; i++)
+    {
+        conns[i].reply_buf = reply_bufs + (size_t)i * UR_REPLY_BUF_SIZE;
+        free_slots[i] = UR_MAX_CONNS - 1 - i;
+    }
+    free_count = UR_MAX_CONNS;
+
+    ur_register_buffers();
+    return ur_arm_accept();
+}
+
+// Submit what is queued, wait for at least one completion and handle all
+// that arrived
+static int ur_enter(void)
+{
+    int ret = 0;
+
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring.sq_local_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+    if (sys_io_uring_enter(ring.ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS) < 0 &&
+        errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+        syslog(LOG_ERR, "io_uring_enter() failed: %s", strerror(errno));
+        return -1;
+    }
+
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail && ret == 0)
+    {
+        ret = ur_handle_cqe(&ring.cqes[head & *ring.cq_mask]);
+        head++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return ret;
+}
+
+int uring_run(int listen_fd)
+{
+    int ret = ur_setup(listen_fd);
+    if (ret != 0)
+    {
+        if (ret == URING_UNSUPPORTED)
+            syslog(LOG_WARNING, "io_uring setup failed: %s", strerror(errno));
+        ur_teardown();
+        return ret;
+    }
+
+    syslog(LOG_INFO, "Serving clients with io_uring");
+    accepted_any = 0;
+    draining = 0;
+
+    while (!stop_requested && ret == 0)
+        ret = ur_enter();
+
+    // Drain, see CONN_DRAIN_MS
+    if (ret == 0 && ur_drain_start() == 0)
+    {
+        uint64_t kick = timer_now() + CONN_DRAIN_GRACE_MS / TIMER_TICK_MS;
+        uint64_t deadline = timer_now() + CONN_DRAIN_MS / TIMER_TICK_MS;
+        while (ret == 0 && free_count < UR_MAX_CONNS && timer_now() < deadline)
+        {
+            if (kick && timer_now() >= kick)
+            {
+                for (int i = 0; i < UR_MAX_CONNS; i++)
+                {
+                    if (conns[i].in_use && !conns[i].done)
+                        shutdown(conns[i].conn.client_fd, SHUT_RD);
+                }
+                kick = 0;
+            }
+            ret = ur_enter();
+        }
+    }
+
+    if (ret == URING_UNSUPPORTED)
+        syslog(LOG_WARNING, "io_uring multishot accept unsupported");
+    ur_teardown();
+    return ret;
+}
+
+#endif /* AESD_IO_URING */
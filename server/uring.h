@@ -0,0 +1,13 @@
+#ifndef URING_H
+#define URING_H
+
+// uring_run() found no usable io_uring and served nothing
+#define URING_UNSUPPORTED 1
+
+// Serve every client from the calling thread with io_uring. Returns 0 when
+// stop_requested is set, URING_UNSUPPORTED when the kernel (or the build,
+// without AESD_IO_URING) lacks the required features, or -1 on failure.
+// listen_fd is left untouched, so the caller can fall back to another mode.
+int uring_run(int listen_fd);
+
+#endif /* URING_H */
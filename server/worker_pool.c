@@ -0,0 +1,267 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <time.h>
+#include <stdatomic.h>
+#include "conn.h"
+#include "worker_pool.h"
+#include "stats.h"
+
+#define DEQUE_SIZE 1024
+
+// Bounded per-worker deque. The owner takes the oldest task from the head;
+// thieves take from the tail, since the newest task in a busy deque is the
+// one that would otherwise wait the longest.
+typedef struct
+{
+    pthread_mutex_t lock;
+    size_t head;
+    size_t count;
+    conn_task_t tasks[DEQUE_SIZE];
+} task_deque_t;
+
+typedef struct
+{
+    pthread_t tid;
+    int index;
+    atomic_int active_fd;
+    task_deque_t deque;
+} worker_t;
+
+static worker_t *workers;
+static int worker_count;
+static int started_count;
+static atomic_uint next_worker;
+static atomic_int pending_tasks;
+static atomic_int stopping;
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static int deque_push_tail(task_deque_t *p_deque, const conn_task_t *p_task)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&p_deque->lock);
+    if (p_deque->count < DEQUE_SIZE)
+    {
+        p_deque->tasks[(p_deque->head + p_deque->count) % DEQUE_SIZE] = *p_task;
+        p_deque->count++;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&p_deque->lock);
+    return ret;
+}
+
+static int deque_pop_head(task_deque_t *p_deque, conn_task_t *p_task)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&p_deque->lock);
+    if (p_deque->count > 0)
+    {
+        *p_task = p_deque->tasks[p_deque->head];
+        p_deque->head = (p_deque->head + 1) % DEQUE_SIZE;
+        p_deque->count--;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&p_deque->lock);
+    return ret;
+}
+
+static int deque_steal_tail(task_deque_t *p_deque, conn_task_t *p_task)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&p_deque->lock);
+    if (p_deque->count > 0)
+    {
+        p_deque->count--;
+        *p_task = p_deque->tasks[(p_deque->head + p_deque->count) % DEQUE_SIZE];
+        ret = 0;
+    }
+    pthread_mutex_unlock(&p_deque->lock);
+    return ret;
+}
+
+static int worker_pool_busy(void)
+{
+    if (atomic_load(&pending_tasks) > 0)
+        return 1;
+    for (int i = 0; i < worker_count; i++)
+    {
+        if (atomic_load(&workers[i].active_fd) >= 0)
+            return 1;
+    }
+    return 0;
+}
+
+// Own deque first, then scan the others starting after ourselves
+static int worker_take_task(worker_t *p_worker, conn_task_t *p_task)
+{
+    if (deque_pop_head(&p_worker->deque, p_task) == 0)
+        return 0;
+
+    for (int i = 1; i < worker_count; i++)
+    {
+        worker_t *p_victim = &workers[(p_worker->index + i) % worker_count];
+        if (deque_steal_tail(&p_victim->deque, p_task) == 0)
+            return 0;
+    }
+    return -1;
+}
+
+static void handle_client(worker_t *p_worker, const conn_task_t *p_task)
+{
+    conn_t conn;
+
+    stats_record(STAT_PHASE_ACCEPT, stats_now() - p_task->accepted_ns);
+    conn_init(&conn, p_task->client_fd, p_task->ipstr);
+    atomic_store(&p_worker->active_fd, p_task->client_fd);
+    conn_process(&conn);
+    atomic_store(&p_worker->active_fd, -1);
+    conn_close(&conn);
+}
+
+static void *worker_thread(void *arg)
+{
+    worker_t *p_worker = (worker_t *)arg;
+    conn_task_t task;
+
+    for (;;)
+    {
+        if (worker_take_task(p_worker, &task) == 0)
+        {
+            atomic_fetch_sub(&pending_tasks, 1);
+            handle_client(p_worker, &task);
+            continue;
+        }
+
+        pthread_mutex_lock(&idle_mutex);
+        while (atomic_load(&pending_tasks) == 0 && !atomic_load(&stopping))
+            pthread_cond_wait(&idle_cond, &idle_mutex);
+        pthread_mutex_unlock(&idle_mutex);
+
+        if (atomic_load(&stopping))
+            break;
+    }
+    return NULL;
+}
+
+int worker_pool_start(int n_workers)
+{
+    if (n_workers <= 0)
+    {
+        long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        n_workers = n_cpus > 0 ? (int)n_cpus : 1;
+    }
+
+    workers = calloc(n_workers, sizeof(worker_t));
+    if (!workers)
+    {
+        syslog(LOG_ERR, "Memory allocation failed");
+        return -1;
+    }
+
+    for (int i = 0; i < n_workers; i++)
+    {
+        workers[i].index = i;
+        atomic_init(&workers[i].active_fd, -1);
+        pthread_mutex_init(&workers[i].deque.lock, NULL);
+    }
+    worker_count = n_workers;
+
+    for (int i = 0; i < n_workers; i++)
+    {
+        if (pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i]) != 0)
+        {
+            syslog(LOG_ERR, "pthread_create() failed for worker thread");
+            started_count = i;
+            worker_pool_stop(NULL);
+            return -1;
+        }
+    }
+    started_count = n_workers;
+
+    syslog(LOG_INFO, "Started %d worker threads", n_workers);
+    return 0;
+}
+
+int worker_pool_submit(const conn_task_t *p_task)
+{
+    unsigned int start = atomic_fetch_add(&next_worker, 1);
+
+    // Count the task before it becomes visible so a worker taking it never
+    // drives the count negative
+    atomic_fetch_add(&pending_tasks, 1);
+    for (int i = 0; i < worker_count; i++)
+    {
+        if (deque_push_tail(&workers[(start + i) % worker_count].deque, p_task) == 0)
+        {
+            pthread_mutex_lock(&idle_mutex);
+            pthread_cond_signal(&idle_cond);
+            pthread_mutex_unlock(&idle_mutex);
+            return 0;
+        }
+    }
+    atomic_fetch_sub(&pending_tasks, 1);
+    return -1;
+}
+
+void worker_pool_stop(void (*p_unserved)(const conn_task_t *p_task))
+{
+    conn_task_t task;
+
+    // Queued connections are handed on before workers can take them
+    for (int i = 0; p_unserved && i < worker_count; i++)
+    {
+        while (deque_pop_head(&workers[i].deque, &task) == 0)
+        {
+            atomic_fetch_sub(&pending_tasks, 1);
+            p_unserved(&task);
+        }
+    }
+
+    pthread_mutex_lock(&idle_mutex);
+    atomic_store(&stopping, 1);
+    pthread_cond_broadcast(&idle_cond);
+    pthread_mutex_unlock(&idle_mutex);
+
+    // Drain, see CONN_DRAIN_GRACE_MS. Workers blocked on clients still
+    // connected after the grace period are kicked.
+    uint64_t kick = timer_now() + CONN_DRAIN_GRACE_MS / TIMER_TICK_MS;
+    while (worker_pool_busy() && timer_now() < kick)
+    {
+        struct timespec tick = {.tv_nsec = TIMER_TICK_MS * 1000000L};
+        nanosleep(&tick, NULL);
+    }
+    for (int i = 0; i < worker_count; i++)
+    {
+        int fd = atomic_load(&workers[i].active_fd);
+        if (fd >= 0)
+            shutdown(fd, SHUT_RD);
+    }
+
+    for (int i = 0; i < started_count; i++)
+        pthread_join(workers[i].tid, NULL);
+
+    for (int i = 0; i < worker_count; i++)
+    {
+        while (deque_pop_head(&workers[i].deque, &task) == 0)
+        {
+            if (p_unserved)
+                p_unserved(&task);
+            else
+                close(task.client_fd);
+        }
+        pthread_mutex_destroy(&workers[i].deque.lock);
+    }
+
+    free(workers);
+    workers = NULL;
+    worker_count = 0;
+    started_count = 0;
+}
@@ -0,0 +1,29 @@
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <stdint.h>
+#include "aesdsocket.h"
+
+// Accepted connection handed from the acceptor to a worker, copied by value
+typedef struct
+{
+    int client_fd;
+    char ipstr[INET6_ADDRSTRLEN];
+    uint64_t accepted_ns; // stats_now() when accept() returned it
+} conn_task_t;
+
+// Start n_workers long-lived client handling threads (0 means one per core).
+// A worker serves one connection from accept to close, so the pool only
+// serves n_workers clients at a time; the idle timeout is what frees
+// workers from clients that stall.
+int worker_pool_start(int n_workers);
+
+// Queue a connection on a worker deque. Returns -1 when every deque is full,
+// in which case the caller still owns client_fd.
+int worker_pool_submit(const conn_task_t *p_task);
+
+// Wake and join all workers. Connections that were never served go to
+// p_unserved if given and are closed otherwise.
+void worker_pool_stop(void (*p_unserved)(const conn_task_t *p_task));
+
+#endif /* WORKER_POOL_H */
@@ -0,0 +1,187 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#ifdef AESD_ZLIB
+#include <zlib.h>
+#endif
+#include "store.h"
+#include "zblock.h"
+
+// Direct-mapped: block index picks the slot and a newer block evicts an
+// older one. Replies hold their own reference, so eviction never pulls a
+// block out from under a send.
+#define ZBLOCK_CACHE_SLOTS 256
+
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static zblock_t *cache[ZBLOCK_CACHE_SLOTS];
+
+#ifdef AESD_ZLIB
+
+int zblock_available(void)
+{
+    return 1;
+}
+
+size_t zblock_bound(size_t len)
+{
+    return compressBound(len);
+}
+
+int zblock_compress(const void *src, size_t len, void *dst, size_t *p_dst_len)
+{
+    uLongf dst_len = *p_dst_len;
+    if (compress2(dst, &dst_len, src, len, Z_DEFAULT_COMPRESSION) != Z_OK)
+        return -1;
+    *p_dst_len = dst_len;
+    return 0;
+}
+
+int zblock_uncompress(const void *src, size_t len, void *dst, size_t *p_dst_len)
+{
+    uLongf dst_len = *p_dst_len;
+    if (uncompress(dst, &dst_len, src, len) != Z_OK)
+        return -1;
+    *p_dst_len = dst_len;
+    return 0;
+}
+
+#else
+
+int zblock_available(void)
+{
+    return 0;
+}
+
+size_t zblock_bound(size_t len)
+{
+    return len;
+}
+
+int zblock_compress(const void *src, size_t len, void *dst, size_t *p_dst_len)
+{
+    (void)src;
+    (void)len;
+    (void)dst;
+    (void)p_dst_len;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+int zblock_uncompress(const void *src, size_t len, void *dst, size_t *p_dst_len)
+{
+    (void)src;
+    (void)len;
+    (void)dst;
+    (void)p_dst_len;
+    errno = EOPNOTSUPP;
+    return -1;
+}
+
+#endif /* AESD_ZLIB */
+
+// Compress block index from the raw bytes the store returns
+static int zblock_build(uint64_t index, unsigned char *dst, size_t *p_dst_len)
+{
+    char *raw = malloc(ZBLOCK_SIZE);
+    size_t got = 0;
+
+    if (!raw)
+        return -1;
+    // Stores may return less than asked, e.g. at a segment boundary
+    while (got < ZBLOCK_SIZE)
+    {
+        ssize_t n = store_read((off_t)index * ZBLOCK_SIZE + got, raw + got, ZBLOCK_SIZE - got);
+        if (n <= 0)
+        {
+            free(raw);
+            return -1;
+        }
+        got += n;
+    }
+    int ret = zblock_compress(raw, ZBLOCK_SIZE, dst, p_dst_len);
+    free(raw);
+    return ret;
+}
+
+int zblock_get(uint64_t index, zblock_t **pp_block)
+{
+    off_t begin = (off_t)index * ZBLOCK_SIZE;
+    int slot = index % ZBLOCK_CACHE_SLOTS;
+
+    if (!zblock_available() || begin < store_start() || begin + ZBLOCK_SIZE > store_size())
+        return -1;
+
+    pthread_mutex_lock(&cache_mutex);
+    zblock_t *p_block = cache[slot];
+    if (p_block && p_block->index == index)
+    {
+        atomic_fetch_add(&p_block->refs, 1);
+        pthread_mutex_unlock(&cache_mutex);
+        *pp_block = p_block;
+        return 0;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+
+    // A store that keeps blocks compressed at rest hands them over as they
+    // are; otherwise compress now, without holding the cache lock
+    size_t cap = zblock_bound(ZBLOCK_SIZE);
+    p_block = malloc(sizeof(zblock_t) + cap);
+    if (!p_block)
+        return -1;
+    ssize_t n = store_read_block(index, p_block->data, cap);
+    if (n > 0)
+        p_block->z_len = n;
+    else
+    {
+        p_block->z_len = cap;
+        if (zblock_build(index, p_block->data, &p_block->z_len) != 0)
+        {
+            free(p_block);
+            return -1;
+        }
+    }
+    zblock_t *p_small = realloc(p_block, sizeof(zblock_t) + p_block->z_len);
+    if (p_small)
+        p_block = p_small;
+    p_block->index = index;
+    p_block->raw_len = ZBLOCK_SIZE;
+    atomic_init(&p_block->refs, 2); // the cache's and the caller's
+
+    pthread_mutex_lock(&cache_mutex);
+    zblock_t *p_old = cache[slot];
+    if (p_old && p_old->index == index)
+    {
+        // Another reply compressed it meanwhile; share that one
+        atomic_fetch_add(&p_old->refs, 1);
+        pthread_mutex_unlock(&cache_mutex);
+        free(p_block);
+        *pp_block = p_old;
+        return 0;
+    }
+    cache[slot] = p_block;
+    pthread_mutex_unlock(&cache_mutex);
+
+    zblock_put(p_old);
+    *pp_block = p_block;
+    return 0;
+}
+
+void zblock_put(zblock_t *p_block)
+{
+    if (p_block && atomic_fetch_sub(&p_block->refs, 1) == 1)
+        free(p_block);
+}
+
+void zblock_cache_clear(void)
+{
+    pthread_mutex_lock(&cache_mutex);
+    for (int i = 0; i < ZBLOCK_CACHE_SLOTS; i++)
+    {
+        zblock_put(cache[i]);
+        cache[i] = NULL;
+    }
+    pthread_mutex_unlock(&cache_mutex);
+}
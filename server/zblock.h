@@ -0,0 +1,45 @@
+#ifndef ZBLOCK_H
+#define ZBLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+// Block compression of the log. The log is cut into ZBLOCK_SIZE blocks at
+// fixed logical offsets; a block is sealed once the store has grown past
+// its end and never changes after that. Each sealed block is compressed
+// once, with zlib, and the result is cached and shared by every reply that
+// sends it. Without a build with AESD_ZLIB nothing compresses and callers
+// fall back to raw bytes.
+#define ZBLOCK_SIZE (64 * 1024)
+
+typedef struct
+{
+    _Atomic int refs;
+    uint64_t index;
+    size_t raw_len;
+    size_t z_len;
+    unsigned char data[];
+} zblock_t;
+
+// Whether this build can compress at all
+int zblock_available(void);
+
+// Worst-case compressed size of len bytes
+size_t zblock_bound(size_t len);
+
+// Compress or expand one block. *p_dst_len holds the room in dst on entry
+// and the length produced on return.
+int zblock_compress(const void *src, size_t len, void *dst, size_t *p_dst_len);
+int zblock_uncompress(const void *src, size_t len, void *dst, size_t *p_dst_len);
+
+// Take a reference to sealed block index in compressed form, compressing
+// and caching it on first use. Fails if the block is not sealed, retention
+// already dropped it or compression is unavailable.
+int zblock_get(uint64_t index, zblock_t **pp_block);
+void zblock_put(zblock_t *p_block);
+
+// Forget every cached block; the store behind them is going away
+void zblock_cache_clear(void);
+
+#endif /* ZBLOCK_H */